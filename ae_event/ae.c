@@ -41,7 +41,9 @@
 #include <sys/time.h>
 #include <sys/types.h>
 #include <sys/select.h>
-#include <sys/sysinfo.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <stdint.h>
 
 
 /* Include the best multiplexing layer supported by this system.
@@ -54,50 +56,198 @@
 
 #include "ae.h"
 
-#ifdef HAVE_EPOLL
+/* Registered event of fd, NULL if no fd of its page was ever registered.
+ * Two loads, independent of the highest fd. */
+static inline aeFileEvent *aeFileEventOf(aeEventLoop *eventLoop, int fd)
+{
+	int page = fd >> AE_FD_PAGE_BITS;
+
+	if (page >= eventLoop->npages || !eventLoop->events[page])
+		return NULL;
+	return &eventLoop->events[page][fd & AE_FD_PAGE_MASK];
+}
+
+#if defined(HAVE_IO_URING)
+#	include "ae_uring.h"
+#elif defined(HAVE_EPOLL)
 #	include "ae_epoll.h"
-#else
+#elif defined(HAVE_SELECT)
 #	include "ae_select.h"
+#else
+#	include "ae_poll.h"
+#endif
+
+#ifndef AE_API_FIRED
+/* The j-th event of the last poll, from the fired array. Backends that
+ * can reach the aeFileEvent from their own poll results define
+ * AE_API_FIRED and their own aeApiFired(). */
+static inline aeFileEvent *aeApiFired(aeEventLoop *eventLoop, int j, int *mask)
+{
+	*mask = eventLoop->fired[j].mask;
+	return aeFileEventOf(eventLoop, eventLoop->fired[j].fd);
+}
 #endif
 
+/* Run every task queued by aeSubmit(). The stack is detached in one
+ * atomic exchange, so producers never block the loop and one eventfd
+ * wakeup covers a whole batch of submissions. */
+static int aeProcessTasks(aeEventLoop *eventLoop, int fd, void *clientData, int mask)
+{
+	aeTask *task, *next, *head = NULL;
+	uint64_t count;
+
+	/* reset the counter before detaching, a later push wakes us again */
+	if (read(fd, &count, sizeof(count)) < 0 && errno != EAGAIN)
+		return -1;
+
+	task = __atomic_exchange_n(&eventLoop->tasks, NULL, __ATOMIC_ACQUIRE);
+	/* the stack is newest first, reverse it to keep submission order */
+	while (task) {
+		next = task->next;
+		task->next = head;
+		head = task;
+		task = next;
+	}
+	while (head) {
+		task = head;
+		head = head->next;
+		task->proc(eventLoop, task->arg);
+		zfree(task);
+	}
+	return 0;
+}
+
+/* The event slot of fd, allocating its page on first use. */
+static aeFileEvent *aeFileEventSlot(aeEventLoop *eventLoop, int fd)
+{
+	int page = fd >> AE_FD_PAGE_BITS, i;
+
+	if (page >= eventLoop->npages) {
+		int npages = eventLoop->npages ? eventLoop->npages : 1;
+		aeFileEvent **events;
+
+		while (page >= npages)
+			npages <<= 1;
+		events = zrealloc(eventLoop->events, sizeof(*events) * npages);
+		if (!events)
+			return NULL;
+		memset(events + eventLoop->npages, 0,
+			sizeof(*events) * (npages - eventLoop->npages));
+		eventLoop->events = events;
+		eventLoop->npages = npages;
+	}
+	if (!eventLoop->events[page]) {
+		aeFileEvent *fe = zmalloc(sizeof(*fe) * AE_FD_PAGE_SIZE);
+
+		if (!fe)
+			return NULL;
+		/* Events with mask == AE_NONE are not set. */
+		for (i = 0; i < AE_FD_PAGE_SIZE; i++) {
+			fe[i].mask = AE_NONE;
+			fe[i].fd = (page << AE_FD_PAGE_BITS) + i;
+			fe[i].apiMask = AE_NONE;
+			fe[i].apiPending = 0;
+		}
+		eventLoop->events[page] = fe;
+	}
+	return &eventLoop->events[page][fd & AE_FD_PAGE_MASK];
+}
+
+static void aeFreeFdTable(aeEventLoop *eventLoop)
+{
+	int i;
+
+	for (i = 0; i < eventLoop->npages; i++)
+		zfree(eventLoop->events[i]);
+	zfree(eventLoop->events);
+	eventLoop->events = NULL;
+	eventLoop->npages = 0;
+}
+
 aeEventLoop *aeCreateEventLoop(int setsize)
+{
+	return aeCreateEventLoopEx(setsize, 0);
+}
+
+/* Like aeCreateEventLoop(), flags is a mask of AE_LOOP_* */
+aeEventLoop *aeCreateEventLoopEx(int setsize, int flags)
 {
 	aeEventLoop *eventLoop;
-	int i;
 
 	if (!(eventLoop = zmalloc(sizeof(*eventLoop))))
 		goto err;
 
-	eventLoop->events = zmalloc(sizeof(aeFileEvent) * setsize);
+	eventLoop->wakefd = -1;
+	eventLoop->tasks = NULL;
+	eventLoop->wheel = NULL;
+	eventLoop->connLoop = NULL;
+	eventLoop->events = NULL;
+	eventLoop->npages = 0;
 
-	#ifdef HAVE_EPOLL	
-	eventLoop->fired = zmalloc(sizeof(aeFiredEvent) * MAX_FIRED_EVENTS);
+	/* backends that harvest a bounded batch per poll define its size */
+	#ifdef INIT_FIRED_EVENTS
+	eventLoop->fired = zmalloc(sizeof(aeFiredEvent) * INIT_FIRED_EVENTS);
 	#else
 	eventLoop->fired = zmalloc(sizeof(aeFiredEvent) * setsize);
 	#endif
 
-	if (!eventLoop->events || !eventLoop->fired)
+	if (!eventLoop->fired)
 		goto err;
 
+	eventLoop->clockid = (flags & AE_LOOP_COARSE_CLOCK) ?
+		CLOCK_MONOTONIC_COARSE : CLOCK_MONOTONIC;
+	aeUpdateTime(eventLoop);
+
+	if (flags & AE_LOOP_TIMER_WHEEL) {
+		eventLoop->wheel = timer_wheel_init(NULL, eventLoop->now / 1000);
+		if (!eventLoop->wheel)
+			goto err;
+	}
+
 	eventLoop->setsize = setsize;
-	eventLoop->lastTime = time(NULL);
 	min_heap_init(&eventLoop->heap);
 	eventLoop->stop = 0;
 	eventLoop->maxfd = -1;
 	eventLoop->beforesleep = NULL;
+	eventLoop->pollBatchMax = AE_POLL_BATCH_MAX;
+	eventLoop->pollCalls = 0;
+	eventLoop->pollFull = 0;
+	eventLoop->ctlCalls = 0;
+	eventLoop->ctlSaved = 0;
+	eventLoop->busyPollUs = 0;
+	eventLoop->busyPollSockUs = 0;
+	eventLoop->ioPending = eventLoop->ioDone = 0;
+	eventLoop->pollSpin = 0;
+	eventLoop->spinHits = 0;
+	eventLoop->spinSleeps = 0;
+	eventLoop->timerBudget = 0;
+	eventLoop->timerBudgetUs = 0;
+	eventLoop->timersFired = 0;
+	eventLoop->timerBudgetHits = 0;
+	eventLoop->timersDeferred = 0;
+	eventLoop->timerBudgetNow = 0;
+	eventLoop->statsEnabled = 0;
+	memset(&eventLoop->stats, 0, sizeof(eventLoop->stats));
 	if (aeApiCreate(eventLoop) == -1)
 		goto err;
 
-    /* Events with mask == AE_NONE are not set. So let's initialize the
-     * vector with it. */
-	for (i = 0; i < setsize; i++)
-		eventLoop->events[i].mask = AE_NONE;
+	/* the wakeup fd lets other threads interrupt aeApiPoll() */
+	eventLoop->wakefd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (eventLoop->wakefd == -1
+		|| aeCreateFileEvent(eventLoop, eventLoop->wakefd, AE_READABLE,
+				aeProcessTasks, NULL) == AE_ERR) {
+		aeApiFree(eventLoop);
+		goto err;
+	}
 
 	return eventLoop;
 err:
 	if (eventLoop) {
-		zfree(eventLoop->events);
+		if (eventLoop->wakefd != -1)
+			close(eventLoop->wakefd);
+		aeFreeFdTable(eventLoop);
 		zfree(eventLoop->fired);
+		zfree(eventLoop->wheel);
 		zfree(eventLoop);
 	}
 	return NULL;
@@ -118,45 +268,73 @@ int aeGetSetSize(aeEventLoop *eventLoop)
  * Otherwise AE_OK is returned and the operation is successful. */
 int aeResizeSetSize(aeEventLoop *eventLoop, int setsize)
 {
-	int i;
-	void *events;
-
 	if (setsize == eventLoop->setsize)
 		return AE_OK;
 	if (eventLoop->maxfd >= setsize)
 		return AE_ERR;
 
-	#ifndef HAVE_EPOLL
 	if (aeApiResize(eventLoop, setsize) == -1)
 		return AE_ERR;
-	#endif
 
-	events = zrealloc(eventLoop->events, sizeof(aeFileEvent) * setsize);
-	if (!events)
-		return AE_ERR;
-
-	eventLoop->events = events;
+	/* the fd table is paged and does not depend on setsize */
 	eventLoop->setsize = setsize;
-
-    /* Make sure that if we created new slots, they are initialized with
-     * an AE_NONE mask. */
-	for (i = eventLoop->maxfd + 1; i < setsize; i++)
-		eventLoop->events[i].mask = AE_NONE;
 	return AE_OK;
 }
 
+/*
+ * Busy polling: before a wait that would block, poll with a zero
+ * timeout for up to spinUs microseconds (never past the next timer).
+ * An event that arrives meanwhile is picked up without a sleep and
+ * wakeup, at the price of a core spinning. spinUs 0 turns it off.
+ *
+ * sockUs > 0 also sets SO_BUSY_POLL on every socket registered from
+ * now on, so the kernel polls the NIC queue in the receive path too
+ * (raising it over net.core.busy_read needs CAP_NET_ADMIN; failures
+ * are ignored).
+ */
+void aeSetBusyPoll(aeEventLoop *eventLoop, long long spinUs, int sockUs)
+{
+	eventLoop->busyPollUs = spinUs > 0 ? spinUs : 0;
+	eventLoop->busyPollSockUs = sockUs > 0 ? sockUs : 0;
+}
+
+/* Set how many events one poll may harvest at most. The epoll backend
+ * starts small, doubles its batch each time a poll fills it and shrinks
+ * back while the loop is quiet; other backends ignore it. */
+void aeSetPollBatchMax(aeEventLoop *eventLoop, int max)
+{
+	if (max < 1)
+		max = 1;
+	eventLoop->pollBatchMax = max;
+}
+
 static void aeDeleteMinheap(aeEventLoop *eventLoop)
 {
 	min_heap_destroy(&eventLoop->heap);
+	if (eventLoop->wheel) {
+		timer_wheel_destroy(eventLoop->wheel);
+		zfree(eventLoop->wheel);
+	}
 }
 
 void aeDeleteEventLoop(aeEventLoop *eventLoop)
 {
+	aeTask *task;
+
 	if (!eventLoop)
 		return;
 
+	/* tasks never run are dropped, drop() releases what they carry */
+	while ((task = eventLoop->tasks)) {
+		eventLoop->tasks = task->next;
+		if (task->drop)
+			task->drop(eventLoop, task->arg);
+		zfree(task);
+	}
+	aeDeleteFileEvent(eventLoop, eventLoop->wakefd, AE_READABLE);
+	close(eventLoop->wakefd);
 	aeApiFree(eventLoop);
-	zfree(eventLoop->events);
+	aeFreeFdTable(eventLoop);
 	zfree(eventLoop->fired);
 	aeDeleteMinheap(eventLoop);
 	zfree(eventLoop);
@@ -186,11 +364,17 @@ int aeCreateFileEvent(aeEventLoop *eventLoop, int fd, int mask,
 		eventLoop->setsize = setsize;
 	}
 
-	aeFileEvent *fe = &eventLoop->events[fd];
+	aeFileEvent *fe = aeFileEventSlot(eventLoop, fd);
 
-	if (aeApiAddEvent(eventLoop, fd, mask) == -1)
+	if (!fe || aeApiAddEvent(eventLoop, fd, mask) == -1)
 		return AE_ERR;
 
+#ifdef SO_BUSY_POLL
+	if (eventLoop->busyPollSockUs && fe->mask == AE_NONE)
+		setsockopt(fd, SOL_SOCKET, SO_BUSY_POLL,
+			&eventLoop->busyPollSockUs, sizeof(int));
+#endif
+
 	fe->mask |= mask;
 	if (mask & AE_READABLE)
 		fe->rfileProc = proc;
@@ -206,21 +390,30 @@ int aeCreateFileEvent(aeEventLoop *eventLoop, int fd, int mask,
 
 void aeDeleteFileEvent(aeEventLoop *eventLoop, int fd, int mask)
 {
-	if (fd >= eventLoop->setsize)
-		return;
-	aeFileEvent *fe = &eventLoop->events[fd];
+	aeFileEvent *fe = aeFileEventOf(eventLoop, fd);
 
-	if (fe->mask == AE_NONE)
+	if (!fe || fe->mask == AE_NONE)
 		return;
 
 	fe->mask = fe->mask & (~mask);
+	/* AE_EDGE alone is no interest at all */
+	if (!(fe->mask & (AE_READABLE | AE_WRITABLE)))
+		fe->mask = AE_NONE;
 	if (fd == eventLoop->maxfd && fe->mask == AE_NONE) {
 		/* Update the max fd */
 		int j;
 
-		for (j = eventLoop->maxfd - 1; j >= 0; j--)
-			if (eventLoop->events[j].mask != AE_NONE)
+		for (j = eventLoop->maxfd - 1; j >= 0; j--) {
+			aeFileEvent *page = eventLoop->events[j >> AE_FD_PAGE_BITS];
+
+			if (!page) {
+				/* skip to the end of the previous page */
+				j &= ~AE_FD_PAGE_MASK;
+				continue;
+			}
+			if (page[j & AE_FD_PAGE_MASK].mask != AE_NONE)
 				break;
+		}
 		eventLoop->maxfd = j;
 	}
 
@@ -229,42 +422,63 @@ void aeDeleteFileEvent(aeEventLoop *eventLoop, int fd, int mask)
 
 int aeGetFileEvents(aeEventLoop *eventLoop, int fd)
 {
-	if (fd >= eventLoop->setsize)
-		return 0;
-	aeFileEvent *fe = &eventLoop->events[fd];
+	aeFileEvent *fe = aeFileEventOf(eventLoop, fd);
 
-	return fe->mask;
+	return fe ? fe->mask : 0;
 }
 
-static void aeGetTime(long *seconds, long *milliseconds)
+/* Refresh the cached clock. The loop does it around every wait, call it
+ * yourself only from a callback that ran long enough to matter. The
+ * clock is monotonic: wall clock steps never move timers. */
+static long long aeClock(aeEventLoop *eventLoop)
 {
-#if 0
-	struct timeval tv;
+	struct timespec ts;
 
-	gettimeofday(&tv, NULL);
-	*seconds = tv.tv_sec;
-	*milliseconds = tv.tv_usec / 1000;
-#endif
-	struct sysinfo info;
-	sysinfo(&info);
-	*seconds = info.uptime;
-	*milliseconds = 0L;
+	clock_gettime(eventLoop->clockid, &ts);
+	return (long long)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+long long aeUpdateTime(aeEventLoop *eventLoop)
+{
+	eventLoop->now = aeClock(eventLoop);
+	return eventLoop->now;
+}
+
+/* Current loop time in microseconds, as of the last wait. */
+long long aeNow(aeEventLoop *eventLoop)
+{
+	return eventLoop->now;
+}
+
+/* Timer engine: the min heap, or the timing wheel for loops created
+ * with AE_LOOP_TIMER_WHEEL. */
+static int aeTimerAdd(aeEventLoop *eventLoop, aeTimeEvent *te)
+{
+	if (eventLoop->wheel)
+		return timer_wheel_add(eventLoop->wheel, te);
+	return aetimer_event_add(&eventLoop->heap, te);
+}
+
+static int aeTimerErase(aeEventLoop *eventLoop, aeTimeEvent *te)
+{
+	if (eventLoop->wheel)
+		return timer_wheel_erase(eventLoop->wheel, te);
+	return min_heap_erase(&eventLoop->heap, te);
 }
 
-static void aeAddMillisecondsToNow(long long milliseconds, long *sec,
-				   long *ms)
+/* aeNow() time at which the next timer may fire, -1 if none */
+static long long aeTimerNext(aeEventLoop *eventLoop)
 {
-	long cur_sec, cur_ms, when_sec, when_ms;
+	aeTimeEvent *te;
+	long long tick;
 
-	aeGetTime(&cur_sec, &cur_ms);
-	when_sec = cur_sec + milliseconds / 1000;
-	when_ms = cur_ms + milliseconds % 1000;
-	if (when_ms >= 1000) {
-		when_sec++;
-		when_ms -= 1000;
+	if (eventLoop->wheel) {
+		tick = timer_wheel_next(eventLoop->wheel);
+		return tick == -1 ? -1 : tick * 1000;
 	}
-	*sec = when_sec;
-	*ms = when_ms;
+	if (!(te = min_heap_top(&eventLoop->heap)))
+		return -1;
+	return te->when;
 }
 
 int aeCreateTimeEvent(aeEventLoop *eventLoop,
@@ -274,12 +488,12 @@ int aeCreateTimeEvent(aeEventLoop *eventLoop,
 	if (!te)
 		return AE_ERR;
 
-	aeAddMillisecondsToNow(milliseconds, &te->when_sec, &te->when_ms);
+	te->when = eventLoop->now + milliseconds * 1000;
 	te->timeProc = proc;
 	te->clientData = clientData;
 
-	/* add timer to min heap */
-	if (aetimer_event_add(&eventLoop->heap, te) < 0)
+	/* add timer to min heap or wheel */
+	if (aeTimerAdd(eventLoop, te) < 0)
 		return AE_ERR;
 
 	return AE_OK;
@@ -287,18 +501,16 @@ int aeCreateTimeEvent(aeEventLoop *eventLoop,
 
 int aeDeleteTimeEvent(aeEventLoop *eventLoop, aeTimeEvent *te)
 {
-	if (te->min_heap_idx == -1)
+	if (aeTimerErase(eventLoop, te) < 0)
 		return AE_ERR;
-
-	min_heap_erase(&eventLoop->heap, te);
 	return AE_OK;
 }
 
 int aeModifyTimeEvent(aeEventLoop *eventLoop, long long milliseconds, aeTimeEvent *te)
 {
-	min_heap_erase(&eventLoop->heap, te);
-	aeAddMillisecondsToNow(milliseconds, &te->when_sec, &te->when_ms);
-	return aetimer_event_add(&eventLoop->heap, te);
+	aeTimerErase(eventLoop, te);
+	te->when = eventLoop->now + milliseconds * 1000;
+	return aeTimerAdd(eventLoop, te);
 }
 
 /* Search the first timer to fire.
@@ -313,65 +525,235 @@ int aeModifyTimeEvent(aeEventLoop *eventLoop, long long milliseconds, aeTimeEven
  * 2) Use a skiplist to have this operation as O(1) and insertion as O(log(N)).
  */
 
-/* Process time events */
+/* Limit the timer callbacks one iteration may run, by count and/or by
+ * microseconds spent in them (0 disables either limit). Due timers past
+ * the budget stay queued, the next poll does not block and they run,
+ * oldest first, after the pending I/O has been served. */
+void aeSetTimerBudget(aeEventLoop *eventLoop, int callbacks, long long us)
+{
+	eventLoop->timerBudget = callbacks > 0 ? callbacks : 0;
+	eventLoop->timerBudgetUs = us > 0 ? us : 0;
+}
+
+/* start is the clock when timer processing began, read only when a
+ * time budget is set: eventLoop->now predates the file callbacks. */
+static int aeTimerBudgetSpent(aeEventLoop *eventLoop, int processed,
+			      long long start)
+{
+	if (eventLoop->timerBudget && processed >= eventLoop->timerBudget)
+		return 1;
+	if (eventLoop->timerBudgetUs && processed
+		&& aeClock(eventLoop) - start >= eventLoop->timerBudgetUs)
+		return 1;
+	return 0;
+}
+
+/* Every timer due now is left for a later iteration. They are counted
+ * as they fire, each once however many iterations it waited. */
+static void aeTimerBudgetStop(aeEventLoop *eventLoop)
+{
+	eventLoop->timerBudgetHits++;
+	eventLoop->timerBudgetNow = eventLoop->now;
+}
+
+static inline void aeTimerCountDeferred(aeEventLoop *eventLoop, aeTimeEvent *te)
+{
+	if (te->when <= eventLoop->timerBudgetNow)
+		eventLoop->timersDeferred++;
+}
+
+/* Stats always time callbacks with the precise clock, a coarse loop
+ * clock would round most of them to zero. */
+static long long aeStatsClock(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (long long)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static void aeStatsCallback(aeEventLoop *eventLoop, long long *hist,
+		long long us, void *proc, int fd)
+{
+	aeStats *st = &eventLoop->stats;
+	int b = 0;
+
+	if (us > 0)
+		b = 64 - __builtin_clzll((unsigned long long)us);
+	if (b >= AE_STATS_BUCKETS)
+		b = AE_STATS_BUCKETS - 1;
+	hist[b]++;
+	if (us > st->maxCallbackUs) {
+		st->maxCallbackUs = us;
+		st->maxCallbackProc = proc;
+		st->maxCallbackFd = fd;
+	}
+}
+
+/* account a file or aeIo callback that started at start, return the
+ * time it ended */
+static long long aeStatsFile(aeEventLoop *eventLoop, long long start,
+		void *proc, int fd)
+{
+	long long end = aeStatsClock();
+
+	eventLoop->stats.fileUs += end - start;
+	eventLoop->stats.fileEvents++;
+	aeStatsCallback(eventLoop, eventLoop->stats.fileHist, end - start,
+			proc, fd);
+	return end;
+}
+
+static int aeCallTimer(aeEventLoop *eventLoop, aeTimeEvent *te)
+{
+	aeTimeProc *proc = te->timeProc;
+	long long start, us;
+	int retval;
+
+	if (!eventLoop->statsEnabled)
+		return proc(eventLoop, te->clientData);
+
+	start = aeStatsClock();
+	retval = proc(eventLoop, te->clientData);
+	us = aeStatsClock() - start;
+	eventLoop->stats.timerUs += us;
+	eventLoop->stats.timerEvents++;
+	aeStatsCallback(eventLoop, eventLoop->stats.timerHist, us,
+			(void *)proc, -1);
+	return retval;
+}
+
+/* Enable or disable loop statistics. When enabled every callback costs
+ * one extra clock read (vDSO, no syscall). An iteration whose callbacks
+ * take more than slowUs in total counts as slow (0 disables that). */
+void aeSetStats(aeEventLoop *eventLoop, int enable, long long slowUs)
+{
+	eventLoop->statsEnabled = enable;
+	eventLoop->stats.slowUs = slowUs > 0 ? slowUs : 0;
+}
+
+/* Snapshot the stats. Call it from the loop thread, e.g. from a timer
+ * or a task queued with aeSubmit(). */
+void aeGetStats(aeEventLoop *eventLoop, aeStats *stats)
+{
+	*stats = eventLoop->stats;
+	stats->pollCalls = eventLoop->pollCalls;
+	stats->pollFull = eventLoop->pollFull;
+	stats->ctlCalls = eventLoop->ctlCalls;
+	stats->ctlSaved = eventLoop->ctlSaved;
+	stats->spinHits = eventLoop->spinHits;
+	stats->spinSleeps = eventLoop->spinSleeps;
+	stats->timerBudgetHits = eventLoop->timerBudgetHits;
+	stats->timersDeferred = eventLoop->timersDeferred;
+}
+
+void aeResetStats(aeEventLoop *eventLoop)
+{
+	long long slowUs = eventLoop->stats.slowUs;
+
+	memset(&eventLoop->stats, 0, sizeof(eventLoop->stats));
+	eventLoop->stats.slowUs = slowUs;
+}
+
+/* Process time events. Timers are compared with the cached loop time,
+ * no clock is read per timer. */
 static int processTimeEvents(aeEventLoop *eventLoop)
 {
 	int processed = 0;
+	long long start = eventLoop->timerBudgetUs ? aeClock(eventLoop) : 0;
 	aeTimeEvent *te;
-	time_t now = time(NULL);
-
-    /* If the system clock is moved to the future, and then set back to the
-     * right value, time events may be delayed in a random way. Often this
-     * means that scheduled operations will not be performed soon enough.
-     *
-     * Here we try to detect system clock skews, and force all the time
-     * events to be processed ASAP when this happens: the idea is that
-     * processing events earlier is less dangerous than delaying them
-     * indefinitely, and practice suggests it is. */
-	#if 0
-	if (now < eventLoop->lastTime) {
-		for_each_min_heap_timer(te, &eventLoop->heap, min_heap_size(&eventLoop->heap)) {
-			/* trigger current all timer && sure new timer is the last one */
-			te->when_sec = 0;
-			te->when_ms = 0;
+
+	if (eventLoop->wheel) {
+		/* move everything due to the pending batch */
+		timer_wheel_advance(eventLoop->wheel, eventLoop->now / 1000);
+		/* a callback may cancel timers that are still pending */
+		while (eventLoop->wheel->pending) {
+			int retval;
+
+			if (aeTimerBudgetSpent(eventLoop, processed, start)) {
+				aeTimerBudgetStop(eventLoop);
+				break;
+			}
+			te = timer_wheel_pop(eventLoop->wheel);
+			aeTimerCountDeferred(eventLoop, te);
+			retval = aeCallTimer(eventLoop, te);
+			processed++;
+			if (retval != AE_NOMORE)
+				aeModifyTimeEvent(eventLoop, retval, te);
 		}
-	} 
-	#endif
-	eventLoop->lastTime = now;
+		eventLoop->timersFired += processed;
+		return processed;
+	}
 
 	while ((te = min_heap_top(&eventLoop->heap))) {
-		long now_sec, now_ms;
-
-		aeGetTime(&now_sec, &now_ms);
-		if (now_sec > te->when_sec ||
-			(now_sec == te->when_sec && now_ms >= te->when_ms)) {
+		if (te->when <= eventLoop->now) {
 			int retval;
+
+			if (aeTimerBudgetSpent(eventLoop, processed, start)) {
+				aeTimerBudgetStop(eventLoop);
+				break;
+			}
 			te = min_heap_pop(&eventLoop->heap);
+			aeTimerCountDeferred(eventLoop, te);
 			/* delete it first */
 			aeDeleteTimeEvent(eventLoop, te);
-			retval = te->timeProc(eventLoop, te->clientData);
+			retval = aeCallTimer(eventLoop, te);
 			processed++;
-		    /* After an event is processed our time event list may
-		     * no longer be the same, so we restart from head.
-		     * Still we make sure to don't process events registered
-		     * by event handlers itself in order to don't loop forever.
-		     * To do so we saved the max ID we want to handle.
-		     *
-		     * FUTURE OPTIMIZATIONS:
-		     * Note that this is NOT great algorithmically. Redis uses
-		     * a single time event so it's not a problem but the right
-		     * way to do this is to add the new elements on head, and
-		     * to flag deleted elements in a special way for later
-		     * deletion (putting references to the nodes to delete into
-		     * another linked list). */
-			if (retval != AE_NOMORE)
+			/* Re-armed strictly after now, even for 0 ms, so this
+			 * loop cannot run forever on the same event. */
+			if (retval == 0) {
+				te->when = eventLoop->now + 1;
+				aeTimerAdd(eventLoop, te);
+			} else if (retval != AE_NOMORE) {
 				aeModifyTimeEvent(eventLoop, retval, te);
+			}
 		} else
 			break;
     }
+    eventLoop->timersFired += processed;
     return processed;
 }
 
+/* aeApiPoll() that first spins for up to busyPollUs, see aeSetBusyPoll() */
+static int aeApiPollSpin(aeEventLoop *eventLoop, struct timeval *tvp)
+{
+	struct timeval zero = {0, 0};
+	long long window = eventLoop->busyPollUs, start, now;
+	int numevents;
+
+	if (!window || (tvp && !tvp->tv_sec && !tvp->tv_usec))
+		return aeApiPoll(eventLoop, tvp);
+	if (tvp && tvp->tv_sec * 1000000LL + tvp->tv_usec < window)
+		window = tvp->tv_sec * 1000000LL + tvp->tv_usec;
+
+	start = aeStatsClock();
+	eventLoop->pollSpin = 1;
+	do {
+		if ((numevents = aeApiPoll(eventLoop, &zero)) < 0)
+			break;
+		if (numevents || eventLoop->ioDone) {
+			eventLoop->spinHits++;
+			break;
+		}
+		now = aeStatsClock();
+	} while (now - start < window);
+	eventLoop->pollSpin = 0;
+	if (numevents || eventLoop->ioDone)
+		return numevents;
+
+	eventLoop->spinSleeps++;
+	if (tvp) {
+		/* the spin counts against the timeout */
+		long long us = tvp->tv_sec * 1000000LL + tvp->tv_usec - (now - start);
+
+		if (us < 0)
+			us = 0;
+		tvp->tv_sec = us / 1000000;
+		tvp->tv_usec = us % 1000000;
+	}
+	return aeApiPoll(eventLoop, tvp);
+}
+
 /* Process every pending time event, then every pending file event
  * (that may be registered by time event callbacks just processed).
  * Without special flags the function sleeps until some file event
@@ -388,6 +770,8 @@ static int processTimeEvents(aeEventLoop *eventLoop)
 int aeProcessEvents(aeEventLoop *eventLoop, int flags)
 {
 	int processed = 0, numevents;
+	int stats = eventLoop->statsEnabled;
+	long long start = 0, ts = 0;
 
     /* Nothing to do? return ASAP */
 	if (!(flags & AE_TIME_EVENTS) && !(flags & AE_FILE_EVENTS))
@@ -397,34 +781,26 @@ int aeProcessEvents(aeEventLoop *eventLoop, int flags)
      * file events to process as long as we want to process time
      * events, in order to sleep until the next time event is ready
      * to fire. */
-	if (eventLoop->maxfd != -1 ||
+	if (eventLoop->maxfd != -1 || eventLoop->ioPending ||
 		((flags & AE_TIME_EVENTS) && !(flags & AE_DONT_WAIT))) {
 		int j;
-		aeTimeEvent *shortest = NULL;
+		long long shortest = -1;
 		struct timeval tv, *tvp;
 
 		if (flags & AE_TIME_EVENTS && !(flags & AE_DONT_WAIT))
-			shortest = min_heap_top(&eventLoop->heap);	
-			
-		if (shortest) {
-			long now_sec, now_ms;
+			shortest = aeTimerNext(eventLoop);
+
+		if (shortest != -1) {
+			long long us;
 
 			/* Calculate the time missing for the nearest
 			* timer to fire. */
-			aeGetTime(&now_sec, &now_ms);
+			us = shortest - aeUpdateTime(eventLoop);
+			if (us < 0)
+				us = 0;
 			tvp = &tv;
-			tvp->tv_sec = shortest->when_sec - now_sec;
-			if (shortest->when_ms < now_ms) {
-				tvp->tv_usec =
-					((shortest->when_ms + 1000) - now_ms) * 1000;
-				tvp->tv_sec--;
-			} else {
-				tvp->tv_usec = (shortest->when_ms - now_ms) * 1000;
-			}
-			if (tvp->tv_sec < 0)
-				tvp->tv_sec = 0;
-			if (tvp->tv_usec < 0)
-				tvp->tv_usec = 0;
+			tvp->tv_sec = us / 1000000;
+			tvp->tv_usec = us % 1000000;
 		} else {
 		    /* If we have to check for events but need to return
 		     * ASAP because of AE_DONT_WAIT we need to set the timeout
@@ -438,11 +814,21 @@ int aeProcessEvents(aeEventLoop *eventLoop, int flags)
 			}
 		}
 
-		numevents = aeApiPoll(eventLoop, tvp);
+		if (stats)
+			ts = aeStatsClock();
+		numevents = aeApiPollSpin(eventLoop, tvp);
+		eventLoop->pollCalls++;
+		/* one clock read per wakeup, callbacks and timers share it */
+		aeUpdateTime(eventLoop);
+		if (stats) {
+			start = aeStatsClock();
+			eventLoop->stats.pollUs += start - ts;
+			ts = start;
+		}
 		for (j = 0; j < numevents; j++) {
-			aeFileEvent *fe = &eventLoop->events[eventLoop->fired[j].fd];
-			int mask = eventLoop->fired[j].mask;
-			int fd = eventLoop->fired[j].fd;
+			int mask;
+			aeFileEvent *fe = aeApiFired(eventLoop, j, &mask);
+			int fd = fe->fd;
 			int rfired = 0;
 
 		    /* note the fe->mask & mask & ... code: maybe an already processed
@@ -452,21 +838,55 @@ int aeProcessEvents(aeEventLoop *eventLoop, int flags)
 		     *  first process read evnet ,after write event
 		     */
 			if (fe->mask & mask & AE_READABLE) {
+				aeFileProc *proc = fe->rfileProc;
+
 				rfired = 1;
-				fe->rfileProc(eventLoop, fd, fe->clientData, mask);
+				proc(eventLoop, fd, fe->clientData, mask);
+				if (stats)
+					ts = aeStatsFile(eventLoop, ts, (void *)proc, fd);
 			}
 			if (fe->mask & mask & AE_WRITABLE) {
-				if (!rfired || fe->wfileProc != fe->rfileProc)
-					fe->wfileProc(eventLoop, fd, fe->clientData, mask);
+				aeFileProc *proc = fe->wfileProc;
+
+				if (!rfired || proc != fe->rfileProc) {
+					proc(eventLoop, fd, fe->clientData, mask);
+					if (stats)
+						ts = aeStatsFile(eventLoop, ts, (void *)proc, fd);
+				}
 			}
 			processed++;
 		}
+#ifdef AE_API_IO
+		numevents = aeApiIoReap(eventLoop);
+		for (j = 0; j < numevents; j++) {
+			int res;
+			aeIo *io = aeApiIoDone(eventLoop, j, &res);
+			aeIoProc *proc = io->proc;
+
+			proc(eventLoop, io, res);
+			if (stats)
+				ts = aeStatsFile(eventLoop, ts, (void *)proc, -1);
+		}
+		processed += numevents;
+#endif
 	}
 
 	/* Check time events */
-	if (flags & AE_TIME_EVENTS)
+	if (flags & AE_TIME_EVENTS) {
+		if (stats && !start)
+			start = aeStatsClock();
 		processed += processTimeEvents(eventLoop);
+	}
+
+	if (stats) {
+		aeStats *st = &eventLoop->stats;
 
+		st->iterations++;
+		if (processed > st->maxEvents)
+			st->maxEvents = processed;
+		if (st->slowUs && start && aeStatsClock() - start > st->slowUs)
+			st->slowIterations++;
+	}
 	return processed;	/* return the number of processed file/time events */
 }
 
@@ -502,6 +922,7 @@ int aeWait(int fd, int mask, long long milliseconds)
 void aeMain(aeEventLoop *eventLoop)
 {
 	eventLoop->stop = 0;
+	aeUpdateTime(eventLoop);
 	while (!eventLoop->stop) {
 		if (eventLoop->beforesleep != NULL)
 			eventLoop->beforesleep(eventLoop);
@@ -514,25 +935,149 @@ char *aeGetApiName(void)
 	return aeApiName();
 }
 
+/* Whether the backend honours AE_EDGE; the others report an edge
+ * interest on every poll while the fd stays ready. */
+int aeCanEdge(void)
+{
+#ifdef AE_API_EDGE
+	return 1;
+#else
+	return 0;
+#endif
+}
+
+/* Whether the backend runs aeIo requests (completion mode), only the
+ * io_uring one does. The functions below fail with ENOTSUP elsewhere. */
+int aeCanIo(void)
+{
+#ifdef AE_API_IO
+	return 1;
+#else
+	return 0;
+#endif
+}
+
+/* Receive up to len bytes from fd into buf, or with buf NULL into one
+ * of the loop's buffers (see aeSetIoBuffers()), which proc() finds in
+ * io->buf and hands back with aeReleaseIoBuffer(). proc() runs from
+ * aeProcessEvents() once the data is there: res is the bytes received,
+ * 0 at EOF, -ENOBUFS if no loop buffer was free. */
+int aeSubmitRecv(aeEventLoop *eventLoop, aeIo *io, int fd, char *buf, size_t len)
+{
+#ifdef AE_API_IO
+	return aeApiSubmitRecv(eventLoop, io, fd, buf, len) == -1 ? AE_ERR : AE_OK;
+#else
+	errno = ENOTSUP;
+	return AE_ERR;
+#endif
+}
+
+/* sendmsg() run by the kernel; msg and what it points to must stay
+ * valid until proc() got the bytes sent */
+int aeSubmitSend(aeEventLoop *eventLoop, aeIo *io, int fd, const struct msghdr *msg)
+{
+#ifdef AE_API_IO
+	return aeApiSubmitSend(eventLoop, io, fd, msg) == -1 ? AE_ERR : AE_OK;
+#else
+	errno = ENOTSUP;
+	return AE_ERR;
+#endif
+}
+
+/* Ask the kernel to stop the request. proc() is still called, with
+ * -ECANCELED or with the result if the request finished first. */
+int aeCancelIo(aeEventLoop *eventLoop, aeIo *io)
+{
+#ifdef AE_API_IO
+	if (!io->pending)
+		return AE_OK;
+	return aeApiCancelIo(eventLoop, io) == -1 ? AE_ERR : AE_OK;
+#else
+	errno = ENOTSUP;
+	return AE_ERR;
+#endif
+}
+
+/* Hand count buffers of size bytes to the kernel once, receives with
+ * no buffer of their own take one when data arrives. Once per loop. */
+int aeSetIoBuffers(aeEventLoop *eventLoop, int count, size_t size)
+{
+#ifdef AE_API_IO
+	return aeApiSetIoBuffers(eventLoop, count, size) == -1 ? AE_ERR : AE_OK;
+#else
+	errno = ENOTSUP;
+	return AE_ERR;
+#endif
+}
+
+void aeReleaseIoBuffer(aeEventLoop *eventLoop, char *buf)
+{
+#ifdef AE_API_IO
+	aeApiReleaseIoBuffer(eventLoop, buf);
+#endif
+}
+
 void aeSetBeforeSleepProc(aeEventLoop *eventLoop,
 			  aeBeforeSleepProc *beforesleep)
 {
 	eventLoop->beforesleep = beforesleep;
 }
 
+/* Queue proc(eventLoop, arg) to run on the loop thread. This is the only
+ * call that is safe from other threads: the task is pushed on a lock-free
+ * stack and the eventfd is written only when the stack was empty, so a
+ * burst of submissions costs the loop a single wakeup. */
+int aeSubmit(aeEventLoop *eventLoop, aeTaskProc *proc, void *arg)
+{
+	return aeSubmitEx(eventLoop, proc, NULL, arg);
+}
+
+/* aeSubmit() with drop(eventLoop, arg) called by aeDeleteEventLoop()
+ * for a task that never ran, so arg can own resources. */
+int aeSubmitEx(aeEventLoop *eventLoop, aeTaskProc *proc, aeTaskProc *drop,
+	       void *arg)
+{
+	aeTask *task, *head;
+
+	if (!(task = zmalloc(sizeof(*task))))
+		return AE_ERR;
+	task->proc = proc;
+	task->drop = drop;
+	task->arg = arg;
+
+	head = __atomic_load_n(&eventLoop->tasks, __ATOMIC_RELAXED);
+	do {
+		task->next = head;
+	} while (!__atomic_compare_exchange_n(&eventLoop->tasks, &head, task,
+			1, __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+
+	if (!head)
+		aeWakeup(eventLoop);
+	return AE_OK;
+}
+
+/* Interrupt a blocking aeApiPoll() from any thread. */
+void aeWakeup(aeEventLoop *eventLoop)
+{
+	uint64_t one = 1;
+	ssize_t ret;
+
+	do {
+		ret = write(eventLoop->wakefd, &one, sizeof(one));
+	} while (ret < 0 && errno == EINTR);
+}
+
 ssize_t tread(int fd, void *buf, size_t nbytes, unsigned int timout)
 {
 	int	nfds;
-	fd_set	readfds;
-	struct timeval	tv;
-
-	tv.tv_sec = timout;
-	tv.tv_usec = 0;
+	struct pollfd	pfd;
 
-	FD_ZERO(&readfds);
-	FD_SET(fd, &readfds);
+	/* poll() has no FD_SETSIZE limit on fd */
+	pfd.fd = fd;
+	pfd.events = POLLIN;
+	pfd.revents = 0;
 
-	nfds = select(fd + 1, &readfds, NULL, NULL, &tv);
+	nfds = poll(&pfd, 1, timout * 1000);
 	if (nfds <= 0) {
 		if (nfds == 0)
 			errno = ETIMEDOUT;
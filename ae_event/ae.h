@@ -42,6 +42,7 @@
 #define AE_NONE	0
 #define AE_READABLE	1
 #define AE_WRITABLE	2
+#define AE_EDGE	4	/* edge-triggered, only if aeCanEdge() */
 
 #define AE_FILE_EVENTS	1
 #define AE_TIME_EVENTS	2
@@ -50,10 +51,15 @@
 
 #define AE_NOMORE	-1
 
+/* Default cap on the events one aeApiPoll() may harvest, see
+ * aeSetPollBatchMax() */
+#define AE_POLL_BATCH_MAX	4096
+
 /* Macros */
 #define AE_NOTUSED(V) ((void) V)
 
 struct aeEventLoop;
+struct msghdr;
 
 ssize_t tread(int fd, void *buf, size_t nbytes, unsigned int timout);
 ssize_t treadn(int fd, void *buf, size_t nbytes, unsigned int timout);
@@ -66,10 +72,16 @@ int setnonblock(int sfd);
 typedef int aeFileProc(struct aeEventLoop *eventLoop, int fd, void *clientData, int mask);
 typedef int aeTimeProc(struct aeEventLoop *eventLoop, void *clientData);
 typedef void aeBeforeSleepProc(struct aeEventLoop *eventLoop);
+typedef void aeTaskProc(struct aeEventLoop *eventLoop, void *arg);
+struct aeIo;
+typedef void aeIoProc(struct aeEventLoop *eventLoop, struct aeIo *io, int res);
 
 /* File event structure */
 typedef struct aeFileEvent {
-    int mask; /* one of AE_(READABLE|WRITABLE) */
+    int mask; /* one of AE_(READABLE|WRITABLE), plus AE_EDGE */
+    int fd; /* the fd this slot belongs to, fixed */
+    int apiMask; /* backend: interest committed to the kernel */
+    int apiPending; /* backend: changes not committed yet */
     aeFileProc *rfileProc;
     aeFileProc *wfileProc;
     void *clientData;
@@ -78,12 +90,26 @@ typedef struct aeFileEvent {
 /* Time event structure */
 typedef struct aeTimeEvent {
     int min_heap_idx;
-    long when_sec; /* seconds */
-    long when_ms; /* milliseconds */
+    struct aeTimeEvent *next, **pprev; /* timing wheel slot, NULL pprev if idle */
+    long long when; /* expiry on the aeNow() clock, microseconds */
     aeTimeProc *timeProc;
     void *clientData;
 } aeTimeEvent;
 
+/* A receive or send run by the kernel, see aeSubmitRecv(). Allocated by
+ * the caller like aeTimeEvent, it must stay valid until proc() is called
+ * with the bytes transferred or -errno. */
+typedef struct aeIo {
+    aeIoProc *proc;
+    void *clientData;
+    char *buf; /* receive into the loop's buffers: the one with the data */
+    int pending; /* submitted, proc() not called yet */
+} aeIo;
+
+/* expiry in whole ms, rounded up so a timer never fires early */
+#define aeTimeEventWhenMs(te) \
+        ((unsigned long long)((te)->when + 999) / 1000)
+
 /* A fired event */
 typedef struct aeFiredEvent {
     int fd;
@@ -91,24 +117,115 @@ typedef struct aeFiredEvent {
 } aeFiredEvent;
 
 
+/* A task handed to the loop thread by aeSubmit() */
+typedef struct aeTask {
+    struct aeTask *next;
+    aeTaskProc *proc;
+    aeTaskProc *drop; /* called instead if the loop is deleted first */
+    void *arg;
+} aeTask;
+
 typedef struct min_heap {
         aeTimeEvent **p; //pointer array for record timer event
         unsigned int n; //current use num of heap
         unsigned int a; //all num of heap
 } min_heap_t;
 
+/* Hierarchical timing wheel with 1ms ticks: a 256 slot root wheel and
+ * TW_LEVELS wheels of 64 slots, each slot of level n spans 2^(8+6n) ms */
+#define TW_ROOT_BITS	8
+#define TW_LEVEL_BITS	6
+#define TW_LEVELS	4
+
+typedef struct timer_wheel {
+        unsigned long long now; /* next tick to run, in ms */
+        unsigned int n; /* timers armed, pending ones included */
+        aeTimeEvent *pending; /* expired but not fired yet, oldest first */
+        aeTimeEvent **pending_tail;
+        aeTimeEvent *root[1 << TW_ROOT_BITS];
+        aeTimeEvent *level[TW_LEVELS][1 << TW_LEVEL_BITS];
+} timer_wheel_t;
+
+/* Loop statistics, see aeSetStats(). Callback durations go to log2
+ * buckets: bucket 0 is < 1us, bucket b holds [2^(b-1), 2^b) us and the
+ * last one everything longer. */
+#define AE_STATS_BUCKETS	24
+
+typedef struct aeStats {
+    long long iterations; /* aeProcessEvents() calls */
+    long long pollUs; /* time spent in aeApiPoll() */
+    long long fileUs; /* time spent in file and aeIo callbacks */
+    long long timerUs; /* time spent in timer callbacks */
+    long long fileEvents; /* file and aeIo callbacks run */
+    long long timerEvents; /* timer callbacks run */
+    int maxEvents; /* most callbacks run by one iteration */
+    long long slowUs; /* threshold for slowIterations, 0 = off */
+    long long slowIterations; /* iterations whose callbacks took > slowUs */
+    long long maxCallbackUs; /* longest callback so far */
+    void *maxCallbackProc; /* its aeFileProc, aeIoProc or aeTimeProc */
+    int maxCallbackFd; /* its fd, -1 for a timer or an aeIo */
+    long long fileHist[AE_STATS_BUCKETS];
+    long long timerHist[AE_STATS_BUCKETS];
+    /* copied from the loop by aeGetStats() */
+    long long pollCalls;
+    long long pollFull;
+    long long timerBudgetHits;
+    long long timersDeferred;
+    long long ctlCalls;
+    long long ctlSaved;
+    long long spinHits;
+    long long spinSleeps;
+} aeStats;
+
+/* The fd table is a directory of pages of AE_FD_PAGE_SIZE events, a
+ * page is allocated when one of its fds is first registered and kept
+ * until the loop is deleted. */
+#define AE_FD_PAGE_BITS	10
+#define AE_FD_PAGE_SIZE	(1 << AE_FD_PAGE_BITS)
+#define AE_FD_PAGE_MASK	(AE_FD_PAGE_SIZE - 1)
+
+/* aeCreateEventLoopEx() flags */
+#define AE_LOOP_TIMER_WHEEL	1	/* O(1) timer wheel instead of the min heap */
+#define AE_LOOP_COARSE_CLOCK	2	/* CLOCK_MONOTONIC_COARSE, ms resolution */
+
 /* State of an event based program */
 typedef struct aeEventLoop {
     int maxfd;   /* highest file descriptor currently registered */
     int setsize; /* max number of file descriptors tracked */
     long long timeEventNextId;
-    time_t lastTime;     /* Used to detect system clock skew */
-    aeFileEvent *events; /* Registered events */
+    long long now; /* monotonic clock in us, cached once per wait */
+    clockid_t clockid;
+    aeFileEvent **events; /* Registered events, paged by fd */
+    int npages; /* directory size of events */
     aeFiredEvent *fired; /* Fired events */
     struct min_heap heap;
+    struct timer_wheel *wheel; /* timer engine if AE_LOOP_TIMER_WHEEL */
     int stop;
     void *apidata; /* This is used for polling API specific data */
     aeBeforeSleepProc *beforesleep;
+    int wakefd; /* eventfd, readable when tasks are pending */
+    aeTask *tasks; /* lock-free MPSC stack, newest first */
+    int pollBatchMax; /* cap for backends that size their batch adaptively */
+    long long pollCalls; /* aeApiPoll() calls */
+    long long pollFull; /* calls that returned as many events as they could take */
+    long long ctlCalls; /* interest syscalls made (epoll_ctl) */
+    long long ctlSaved; /* interest changes that needed no syscall */
+    long long busyPollUs; /* spin with zero-timeout polls before blocking */
+    int busyPollSockUs; /* SO_BUSY_POLL for newly registered sockets */
+    int pollSpin; /* aeApiPoll() is one of the spin's zero-timeout polls */
+    int ioPending; /* aeIo requests submitted and not completed */
+    int ioDone; /* aeIo completions harvested, not dispatched yet */
+    long long spinHits; /* waits that found events while spinning */
+    long long spinSleeps; /* waits that spun the whole window and blocked */
+    int timerBudget; /* max timer callbacks per iteration, 0 = no limit */
+    long long timerBudgetUs; /* max us spent in timer callbacks per iteration */
+    long long timersFired; /* timer callbacks run */
+    long long timerBudgetHits; /* iterations whose timer budget ran out */
+    long long timersDeferred; /* timers the budget made fire an iteration late */
+    long long timerBudgetNow; /* now at the last budget hit, due timers were left */
+    int statsEnabled;
+    aeStats stats;
+    struct conn_loop *connLoop; /* owned by conn.c, see conn_loop_free() */
 } aeEventLoop;
 
 
@@ -118,6 +235,7 @@ typedef struct aeEventLoop {
 
 /* Prototypes */
 aeEventLoop *aeCreateEventLoop(int setsize);
+aeEventLoop *aeCreateEventLoopEx(int setsize, int flags);
 void aeDeleteEventLoop(aeEventLoop *eventLoop);
 void aeStop(aeEventLoop *eventLoop);
 int aeCreateFileEvent(aeEventLoop *eventLoop, int fd, int mask,
@@ -129,12 +247,31 @@ int aeCreateTimeEvent(aeEventLoop *eventLoop, long long milliseconds,
 int aeDeleteTimeEvent(aeEventLoop *eventLoop, aeTimeEvent *te);
 int aeModifyTimeEvent(aeEventLoop *eventLoop, long long milliseconds, aeTimeEvent *te);
 int aeProcessEvents(aeEventLoop *eventLoop, int flags);
+long long aeNow(aeEventLoop *eventLoop);
+long long aeUpdateTime(aeEventLoop *eventLoop);
+void aeSetTimerBudget(aeEventLoop *eventLoop, int callbacks, long long us);
+void aeSetStats(aeEventLoop *eventLoop, int enable, long long slowUs);
+void aeGetStats(aeEventLoop *eventLoop, aeStats *stats);
+void aeResetStats(aeEventLoop *eventLoop);
 int aeWait(int fd, int mask, long long milliseconds);
 void aeMain(aeEventLoop *eventLoop);
 char *aeGetApiName(void);
+int aeCanEdge(void);
+int aeCanIo(void);
+int aeSubmitRecv(aeEventLoop *eventLoop, aeIo *io, int fd, char *buf, size_t len);
+int aeSubmitSend(aeEventLoop *eventLoop, aeIo *io, int fd, const struct msghdr *msg);
+int aeCancelIo(aeEventLoop *eventLoop, aeIo *io);
+int aeSetIoBuffers(aeEventLoop *eventLoop, int count, size_t size);
+void aeReleaseIoBuffer(aeEventLoop *eventLoop, char *buf);
 void aeSetBeforeSleepProc(aeEventLoop *eventLoop, aeBeforeSleepProc *beforesleep);
+int aeSubmit(aeEventLoop *eventLoop, aeTaskProc *proc, void *arg);
+int aeSubmitEx(aeEventLoop *eventLoop, aeTaskProc *proc, aeTaskProc *drop,
+        void *arg);
+void aeWakeup(aeEventLoop *eventLoop);
 int aeGetSetSize(aeEventLoop *eventLoop);
 int aeResizeSetSize(aeEventLoop *eventLoop, int setsize);
+void aeSetBusyPoll(aeEventLoop *eventLoop, long long spinUs, int sockUs);
+void aeSetPollBatchMax(aeEventLoop *eventLoop, int max);
 
 int min_heap_elt_is_top(const aeTimeEvent *e);
 int min_heap_empty(min_heap_t *s);
@@ -147,4 +284,14 @@ void min_heap_destroy(min_heap_t *heap);
 void aetimer_event_init(aeTimeEvent *te);
 int aetimer_event_add(min_heap_t *s, aeTimeEvent *te);
 
+timer_wheel_t *timer_wheel_init(timer_wheel_t *tw, unsigned long long now);
+void timer_wheel_destroy(timer_wheel_t *tw);
+int timer_wheel_add(timer_wheel_t *tw, aeTimeEvent *te);
+int timer_wheel_erase(timer_wheel_t *tw, aeTimeEvent *te);
+int timer_wheel_elt_pending(const aeTimeEvent *te);
+unsigned int timer_wheel_size(timer_wheel_t *tw);
+void timer_wheel_advance(timer_wheel_t *tw, unsigned long long now);
+aeTimeEvent *timer_wheel_pop(timer_wheel_t *tw);
+long long timer_wheel_next(timer_wheel_t *tw);
+
 #endif
@@ -32,12 +32,36 @@
 
 #include <sys/epoll.h>
 
-#define MAX_FIRED_EVENTS 32
+/* The batch starts at INIT_FIRED_EVENTS, doubles whenever epoll_wait()
+ * fills it, up to eventLoop->pollBatchMax, and halves after
+ * SHRINK_FIRED_POLLS polls in a row used less than a quarter of it. */
+#define INIT_FIRED_EVENTS 32
+#define SHRINK_FIRED_POLLS 64
 
+/* data.ptr holds the aeFileEvent of the fd, events are dispatched
+ * straight from the epoll_wait() results, the fired array is unused */
+#define AE_API_FIRED
+
+/* AE_EDGE maps to EPOLLET */
+#define AE_API_EDGE
+
+/*
+ * Interest changes to fds already in the kernel are not sent right
+ * away: the fd goes on the dirty list and aeApiCommit() makes one
+ * epoll_ctl() for the net change before the next wait, none if a
+ * callback removed and re-added the same interest. New registrations
+ * are made at once so aeCreateFileEvent() still reports bad fds, and so
+ * are removals: the caller usually closes the fd next, and a DEL after
+ * close() fails while a dup of the file keeps the registration alive.
+ */
 typedef struct aeApiState {
 	int epfd;
 	int maxevents;
+	int lowpolls;	/* consecutive polls that used < maxevents/4 */
 	struct epoll_event *events;
+	int *dirty;	/* fds with apiPending changes */
+	int ndirty;
+	int dirtysize;
 } aeApiState;
 
 static int aeApiCreate(aeEventLoop *eventLoop)
@@ -46,13 +70,16 @@ static int aeApiCreate(aeEventLoop *eventLoop)
 
 	if (!state)
 		return -1;
-	state->events = zmalloc(sizeof(struct epoll_event) * MAX_FIRED_EVENTS);
+	state->events = zmalloc(sizeof(struct epoll_event) * INIT_FIRED_EVENTS);
 	if (!state->events) {
 		zfree(state);
 		return -1;
 	}
 
-	state->maxevents = MAX_FIRED_EVENTS;
+	state->maxevents = INIT_FIRED_EVENTS;
+	state->lowpolls = 0;
+	state->dirty = NULL;
+	state->ndirty = state->dirtysize = 0;
 	state->epfd = epoll_create(1024);	/* 1024 is just an hint for the kernel */
 	if (state->epfd == -1) {
 		zfree(state->events);
@@ -65,24 +92,22 @@ static int aeApiCreate(aeEventLoop *eventLoop)
 
 static int aeApiResize(aeEventLoop *eventLoop, int setsize)
 {
-	void *events;
-	void *fired;
+	/* the batch follows the load, not the set size */
+	return 0;
+}
+
+/* Resize the epoll_event array to maxevents slots, the entries of the
+ * current batch are preserved by realloc. */
+static void aeApiResizeBatch(aeEventLoop *eventLoop, int maxevents)
+{
 	aeApiState *state = eventLoop->apidata;
-	if (setsize <= state->maxevents)
-		return 0;
+	void *events;
 
-	events = zrealloc(state->events, sizeof(struct epoll_event) * setsize);
+	events = zrealloc(state->events, sizeof(struct epoll_event) * maxevents);
 	if (!events)
-		return -1;
+		return;
 	state->events = events;
-
-	fired = zrealloc(eventLoop->fired, sizeof(aeFiredEvent) * setsize);
-	if (!fired)
-		return -1;
-
-	eventLoop->fired = fired;
-	state->maxevents = setsize;
-	return 0;
+	state->maxevents = maxevents;
 }
 
 static void aeApiFree(aeEventLoop *eventLoop)
@@ -91,88 +116,195 @@ static void aeApiFree(aeEventLoop *eventLoop)
 
 	close(state->epfd);
 	zfree(state->events);
+	zfree(state->dirty);
 	zfree(state);
 }
 
-static int aeApiAddEvent(aeEventLoop *eventLoop, int fd, int mask)
+static int aeApiCtl(aeEventLoop *eventLoop, int op, aeFileEvent *fe, int mask)
 {
-	struct epoll_event ee;
 	aeApiState *state = eventLoop->apidata;
-	
-    /* If the fd was already monitored for some event, we need a MOD
-     * operation. Otherwise we need an ADD operation. */
-	int op = eventLoop->events[fd].mask == AE_NONE ?
-		EPOLL_CTL_ADD : EPOLL_CTL_MOD;
+	struct epoll_event ee;
 
 	ee.events = 0;
-	mask |= eventLoop->events[fd].mask;	/* Merge old events */
 	if (mask & AE_READABLE)
 		ee.events |= EPOLLIN;
 	if (mask & AE_WRITABLE)
 		ee.events |= EPOLLOUT;
+	if (mask & AE_EDGE)
+		ee.events |= EPOLLET;
+	ee.data.ptr = fe;
+	eventLoop->ctlCalls++;
+	/* Note, Kernel < 2.6.9 requires a non null event pointer even for
+	 * EPOLL_CTL_DEL. */
+	return epoll_ctl(state->epfd, op, fe->fd, &ee);
+}
 
-	ee.data.u64 = 0;		/* avoid valgrind warning */
-	ee.data.fd = fd;
-	if (epoll_ctl(state->epfd, op, fd, &ee) == -1)
-		return -1;
-	return 0;
+/* Bring the kernel to fe->mask. apiMask may be stale when the fd was
+ * closed and reused, hence the fallbacks. */
+static void aeApiCommitOne(aeEventLoop *eventLoop, aeFileEvent *fe)
+{
+	int mask = fe->mask, ret;
+
+	if (mask == fe->apiMask)
+		return;
+	if (mask == AE_NONE) {
+		aeApiCtl(eventLoop, EPOLL_CTL_DEL, fe, mask);
+		fe->apiMask = AE_NONE;
+		return;
+	}
+	if (fe->apiMask == AE_NONE) {
+		ret = aeApiCtl(eventLoop, EPOLL_CTL_ADD, fe, mask);
+		if (ret == -1 && errno == EEXIST)
+			ret = aeApiCtl(eventLoop, EPOLL_CTL_MOD, fe, mask);
+	} else {
+		ret = aeApiCtl(eventLoop, EPOLL_CTL_MOD, fe, mask);
+		if (ret == -1 && errno == ENOENT)
+			ret = aeApiCtl(eventLoop, EPOLL_CTL_ADD, fe, mask);
+	}
+	if (ret == 0)
+		fe->apiMask = mask;
 }
 
-static void aeApiDelEvent(aeEventLoop *eventLoop, int fd, int delmask)
+static void aeApiCommit(aeEventLoop *eventLoop)
 {
-	struct epoll_event ee;
 	aeApiState *state = eventLoop->apidata;
-	int mask = eventLoop->events[fd].mask & (~delmask);
+	int j;
 
-	ee.events = 0;
-	if (mask & AE_READABLE)
-		ee.events |= EPOLLIN;
-	if (mask & AE_WRITABLE)
-		ee.events |= EPOLLOUT;
+	for (j = 0; j < state->ndirty; j++) {
+		aeFileEvent *fe = aeFileEventOf(eventLoop, state->dirty[j]);
+		int changes = fe->apiPending;
+
+		fe->apiPending = 0;
+		if (fe->mask == fe->apiMask) {
+			eventLoop->ctlSaved += changes;
+			continue;
+		}
+		eventLoop->ctlSaved += changes - 1;
+		aeApiCommitOne(eventLoop, fe);
+	}
+	state->ndirty = 0;
+}
 
-	ee.data.u64 = 0;		/* avoid valgrind warning */
-	ee.data.fd = fd;
+static void aeApiDefer(aeEventLoop *eventLoop, aeFileEvent *fe)
+{
+	aeApiState *state = eventLoop->apidata;
 
-	if (mask != AE_NONE) {
-		epoll_ctl(state->epfd, EPOLL_CTL_MOD, fd, &ee);
-	} else {
-		/* Note, Kernel < 2.6.9 requires a non null event pointer even for
-		 * EPOLL_CTL_DEL. */
-		epoll_ctl(state->epfd, EPOLL_CTL_DEL, fd, &ee);
+	if (fe->apiPending) {
+		fe->apiPending++;
+		return;
+	}
+	if (state->ndirty == state->dirtysize) {
+		int size = state->dirtysize ? state->dirtysize * 2 : 64;
+		int *dirty = zrealloc(state->dirty, sizeof(int) * size);
+
+		if (!dirty) {
+			aeApiCommitOne(eventLoop, fe);
+			return;
+		}
+		state->dirty = dirty;
+		state->dirtysize = size;
+	}
+	state->dirty[state->ndirty++] = fe->fd;
+	fe->apiPending = 1;
+}
+
+static int aeApiAddEvent(aeEventLoop *eventLoop, int fd, int mask)
+{
+	aeFileEvent *fe = aeFileEventOf(eventLoop, fd);
+
+	/* fe->mask is updated by the caller once we return */
+	mask |= fe->mask;	/* Merge old events */
+	if (fe->mask != AE_NONE) {
+		aeApiDefer(eventLoop, fe);
+		return 0;
 	}
+	/* A new registration: ADD now to report errors. EEXIST means the
+	 * kernel still knows the file, e.g. an earlier DEL failed. */
+	if (aeApiCtl(eventLoop, EPOLL_CTL_ADD, fe, mask) == -1
+		&& (errno != EEXIST
+			|| aeApiCtl(eventLoop, EPOLL_CTL_MOD, fe, mask) == -1))
+		return -1;
+	fe->apiMask = mask;
+	return 0;
+}
+
+static void aeApiDelEvent(aeEventLoop *eventLoop, int fd, int delmask)
+{
+	aeFileEvent *fe = aeFileEventOf(eventLoop, fd);
+
+	/* fe->mask already has delmask cleared */
+	if (fe->mask == AE_NONE)
+		aeApiCommitOne(eventLoop, fe);
+	else
+		aeApiDefer(eventLoop, fe);
 }
 
 static int aeApiPoll(aeEventLoop *eventLoop, struct timeval *tvp)
 {
 	int retval, numevents = 0;
 	aeApiState *state = eventLoop->apidata;
-    
 
-	retval = epoll_wait(state->epfd, state->events, state->maxevents,
-				tvp ? (tvp->tv_sec * 1000 + tvp->tv_usec / 1000) : -1);
-	if (retval > 0) {
-		int j;
+	if (state->ndirty)
+		aeApiCommit(eventLoop);
+	if (state->maxevents > eventLoop->pollBatchMax)
+		aeApiResizeBatch(eventLoop, eventLoop->pollBatchMax);
 
+	retval = epoll_wait(state->epfd, state->events, state->maxevents,
+				tvp ? (tvp->tv_sec * 1000 + (tvp->tv_usec + 999) / 1000) : -1);
+	if (retval > 0)
 		numevents = retval;
-		for (j = 0; j < numevents; j++) {
-			int mask = 0;
-			struct epoll_event *e = state->events + j;
-
-			if (e->events & EPOLLIN)
-				mask |= AE_READABLE;
-			if (e->events & EPOLLOUT)
-				mask |= AE_WRITABLE;
-			if (e->events & EPOLLERR)
-				mask |= AE_WRITABLE;
-			if (e->events & EPOLLHUP)
-				mask |= AE_WRITABLE;
-			eventLoop->fired[j].fd = e->data.fd;
-			eventLoop->fired[j].mask = mask;
+	/* an empty spin poll says nothing about the batch size */
+	if (!numevents && eventLoop->pollSpin)
+		return 0;
+
+	if (numevents == state->maxevents) {
+		/* more events are probably waiting, take them in one go next time */
+		eventLoop->pollFull++;
+		state->lowpolls = 0;
+		if (state->maxevents < eventLoop->pollBatchMax) {
+			int grow = state->maxevents * 2;
+
+			if (grow > eventLoop->pollBatchMax)
+				grow = eventLoop->pollBatchMax;
+			aeApiResizeBatch(eventLoop, grow);
 		}
+	} else if (numevents < state->maxevents / 4) {
+		if (++state->lowpolls >= SHRINK_FIRED_POLLS
+			&& state->maxevents > INIT_FIRED_EVENTS) {
+			int shrink = state->maxevents / 2;
+
+			if (shrink < INIT_FIRED_EVENTS)
+				shrink = INIT_FIRED_EVENTS;
+			aeApiResizeBatch(eventLoop, shrink);
+			state->lowpolls = 0;
+		}
+	} else {
+		state->lowpolls = 0;
 	}
 	return numevents;
 }
 
+/* The j-th event of the last poll. The pages of the fd table are never
+ * freed, so data.ptr stays valid even if the fd was deleted since. */
+static inline aeFileEvent *aeApiFired(aeEventLoop *eventLoop, int j, int *mask)
+{
+	aeApiState *state = eventLoop->apidata;
+	struct epoll_event *e = state->events + j;
+
+	*mask = 0;
+	if (e->events & EPOLLIN)
+		*mask |= AE_READABLE;
+	if (e->events & EPOLLOUT)
+		*mask |= AE_WRITABLE;
+	/* the read handler gets errors too, e.g. the
+	 * MSG_ZEROCOPY completions on the error queue */
+	if (e->events & EPOLLERR)
+		*mask |= AE_READABLE | AE_WRITABLE;
+	if (e->events & EPOLLHUP)
+		*mask |= AE_WRITABLE;
+	return e->data.ptr;
+}
+
 static char *aeApiName(void)
 {
 	return "epoll";
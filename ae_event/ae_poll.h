@@ -0,0 +1,166 @@
+/* poll(2) based ae.c module
+ *
+ * The registered fds are kept in a dense pollfd array, so a poll costs
+ * O(registered fds) no matter how high the fds are, and there is no
+ * FD_SETSIZE limit. slot[] maps a fd to its pollfd, removal moves the
+ * last entry into the hole. AE_EDGE is ignored, events are always
+ * level-triggered.
+ */
+#ifndef __AE_POLL__
+#define	__AE_POLL__
+
+#include <poll.h>
+#include <string.h>
+
+typedef struct aeApiState {
+	struct pollfd *fds;	/* registered fds, densely packed */
+	int nfds;
+	int size;	/* capacity of fds */
+	int *slot;	/* index in fds by fd, -1 if not registered */
+	int setsize;	/* entries of slot */
+} aeApiState;
+
+static int aeApiCreate(aeEventLoop *eventLoop)
+{
+	aeApiState *state = zmalloc(sizeof(aeApiState));
+	int i;
+
+	if (!state)
+		return -1;
+	state->fds = NULL;
+	state->nfds = state->size = 0;
+	state->setsize = eventLoop->setsize;
+	state->slot = zmalloc(sizeof(int) * state->setsize);
+	if (!state->slot) {
+		zfree(state);
+		return -1;
+	}
+	for (i = 0; i < state->setsize; i++)
+		state->slot[i] = -1;
+	eventLoop->apidata = state;
+	return 0;
+}
+
+static int aeApiResize(aeEventLoop *eventLoop, int setsize)
+{
+	aeApiState *state = eventLoop->apidata;
+	void *fired;
+	int *slot, i;
+
+	/* fired holds at most one entry per registered fd */
+	fired = zrealloc(eventLoop->fired, sizeof(aeFiredEvent) * setsize);
+	if (!fired)
+		return -1;
+	eventLoop->fired = fired;
+	if (setsize <= state->setsize)
+		return 0;
+	if (!(slot = zrealloc(state->slot, sizeof(int) * setsize)))
+		return -1;
+	for (i = state->setsize; i < setsize; i++)
+		slot[i] = -1;
+	state->slot = slot;
+	state->setsize = setsize;
+	return 0;
+}
+
+static void aeApiFree(aeEventLoop *eventLoop)
+{
+	aeApiState *state = eventLoop->apidata;
+
+	zfree(state->fds);
+	zfree(state->slot);
+	zfree(state);
+}
+
+static short aeApiPollEvents(int mask)
+{
+	short events = 0;
+
+	if (mask & AE_READABLE)
+		events |= POLLIN;
+	if (mask & AE_WRITABLE)
+		events |= POLLOUT;
+	return events;
+}
+
+static int aeApiAddEvent(aeEventLoop *eventLoop, int fd, int mask)
+{
+	aeApiState *state = eventLoop->apidata;
+	int j = state->slot[fd];
+
+	mask |= aeFileEventOf(eventLoop, fd)->mask;	/* Merge old events */
+	if (j == -1) {
+		if (state->nfds == state->size) {
+			int size = state->size ? state->size * 2 : 64;
+			struct pollfd *fds = zrealloc(state->fds,
+					sizeof(struct pollfd) * size);
+
+			if (!fds)
+				return -1;
+			state->fds = fds;
+			state->size = size;
+		}
+		j = state->nfds++;
+		state->fds[j].fd = fd;
+		state->fds[j].revents = 0;
+		state->slot[fd] = j;
+	}
+	state->fds[j].events = aeApiPollEvents(mask);
+	return 0;
+}
+
+static void aeApiDelEvent(aeEventLoop *eventLoop, int fd, int delmask)
+{
+	aeApiState *state = eventLoop->apidata;
+	int mask = aeFileEventOf(eventLoop, fd)->mask & (~delmask);
+	int j = state->slot[fd];
+
+	if (j == -1)
+		return;
+	if (mask & (AE_READABLE | AE_WRITABLE)) {
+		state->fds[j].events = aeApiPollEvents(mask);
+		return;
+	}
+	/* fill the hole with the last entry */
+	state->slot[fd] = -1;
+	if (j != --state->nfds) {
+		state->fds[j] = state->fds[state->nfds];
+		state->slot[state->fds[j].fd] = j;
+	}
+}
+
+static int aeApiPoll(aeEventLoop *eventLoop, struct timeval *tvp)
+{
+	aeApiState *state = eventLoop->apidata;
+	int retval, j, numevents = 0;
+
+	retval = poll(state->fds, state->nfds,
+			tvp ? (tvp->tv_sec * 1000 + (tvp->tv_usec + 999) / 1000) : -1);
+	for (j = 0; j < state->nfds && numevents < retval; j++) {
+		short revents = state->fds[j].revents;
+		int mask = 0;
+
+		if (!revents)
+			continue;
+		if (revents & POLLIN)
+			mask |= AE_READABLE;
+		if (revents & POLLOUT)
+			mask |= AE_WRITABLE;
+		/* same as ae_epoll.h, errors reach the read handler too */
+		if (revents & (POLLERR | POLLNVAL))
+			mask |= AE_READABLE | AE_WRITABLE;
+		if (revents & POLLHUP)
+			mask |= AE_WRITABLE;
+		eventLoop->fired[numevents].fd = state->fds[j].fd;
+		eventLoop->fired[numevents].mask = mask;
+		numevents++;
+	}
+	return numevents;
+}
+
+static char *aeApiName(void)
+{
+	return "poll";
+}
+
+#endif				/* __AE_POLL__ */
@@ -105,9 +105,9 @@ static int aeApiPoll(aeEventLoop *eventLoop, struct timeval *tvp)
 	if (retval > 0) {
 		for (j = 0; j <= eventLoop->maxfd; j++) {
 			int mask = 0;
-			aeFileEvent *fe = &eventLoop->events[j];
+			aeFileEvent *fe = aeFileEventOf(eventLoop, j);
 
-			if (fe->mask == AE_NONE)
+			if (!fe || fe->mask == AE_NONE)
 				continue;
 			if (fe->mask & AE_READABLE && FD_ISSET(j,&state->_rfds))
 				mask |= AE_READABLE;
@@ -0,0 +1,510 @@
+/* Linux io_uring(7) based ae.c module
+ *
+ * Readiness is tracked with one-shot IORING_OP_POLL_ADD requests: every
+ * completion reports the current state of the fd and the poll is armed
+ * again on the next aeApiPoll() while the fd is still registered, which
+ * gives the same level-triggered contract as ae_epoll.h. Interest changes
+ * only queue SQEs, they are submitted together with the wait in a single
+ * io_uring_enter(), so a loop iteration costs one syscall no matter how
+ * many fds toggled AE_WRITABLE during dispatch.
+ *
+ * Completion mode (AE_API_IO): aeSubmitRecv()/aeSubmitSend() queue the
+ * I/O itself on the ring and the result comes back as a completion, so
+ * a request costs no read()/write() of its own. Receives may pick a
+ * buffer from a set provided to the kernel once by aeSetIoBuffers(): it
+ * is taken only when data arrives, idle sockets hold none.
+ *
+ * Needs a kernel with IORING_FEAT_EXT_ARG (5.11+) for the wait timeout.
+ * Note that a pending poll holds a reference on its file, so a fd that is
+ * closed right after aeDeleteFileEvent() is released by the kernel when
+ * the queued POLL_REMOVE is submitted at the top of the next poll.
+ */
+#ifndef __AE_URING__
+#define	__AE_URING__
+
+#include <stdint.h>
+#include <string.h>
+#include <poll.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+
+#define MAX_FIRED_EVENTS	256
+#define INIT_FIRED_EVENTS	MAX_FIRED_EVENTS
+#define AE_URING_ENTRIES	1024
+/* user_data of POLL_REMOVE requests, their completions are ignored */
+#define AE_URING_NOTAG		UINT64_MAX
+/* user_data of aeIo requests: the aeIo pointer with the top bit set,
+ * polls carry a 31 bit generation above the fd */
+#define AE_URING_IO		(1ULL << 63)
+#define AE_URING_GEN_MASK	0x7fffffffu
+/* buffer group of the aeSetIoBuffers() set */
+#define AE_URING_BGID		0
+
+#define AE_API_IO
+
+typedef struct aeApiState {
+	int ringfd;
+	unsigned sq_entries;
+	unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+	unsigned sq_local_tail;	/* SQEs prepared, published on enter */
+	unsigned to_submit;
+	struct io_uring_sqe *sqes;
+	unsigned *cq_head, *cq_tail, *cq_mask;
+	struct io_uring_cqe *cqes;
+	void *sq_ring, *cq_ring;
+	size_t sq_ring_sz, cq_ring_sz, sqes_sz;
+	int setsize;
+	int *armed;	/* mask of the poll pending in the kernel, per fd */
+	uint32_t *gen;	/* bumped on every re-arm, drops stale completions */
+	int nrearm;
+	int rearm[MAX_FIRED_EVENTS];	/* fds completed by the last poll */
+	char *iobufs;	/* aeSetIoBuffers() set, iobuf_size bytes each */
+	size_t iobuf_size;
+	int ndone;
+	struct {
+		aeIo *io;
+		int res;
+	} done[MAX_FIRED_EVENTS];	/* harvested aeIo completions */
+} aeApiState;
+
+static inline uint64_t aeUringPollTag(aeApiState *state, int fd)
+{
+	return ((uint64_t)(state->gen[fd] & AE_URING_GEN_MASK) << 32)
+		| (uint32_t)fd;
+}
+
+static int aeUringEnter(aeApiState *state, unsigned min_complete,
+		unsigned flags, void *arg, size_t argsz)
+{
+	int ret;
+
+	__atomic_store_n(state->sq_tail, state->sq_local_tail, __ATOMIC_RELEASE);
+	ret = syscall(__NR_io_uring_enter, state->ringfd, state->to_submit,
+			min_complete, flags, arg, argsz);
+	if (ret > 0)
+		state->to_submit -= ret;
+	return ret;
+}
+
+static struct io_uring_sqe *aeUringGetSqe(aeApiState *state)
+{
+	struct io_uring_sqe *sqe;
+	unsigned idx;
+
+	if (state->sq_local_tail - __atomic_load_n(state->sq_head,
+			__ATOMIC_ACQUIRE) >= state->sq_entries) {
+		/* ring full, flush what we have without waiting */
+		aeUringEnter(state, 0, 0, NULL, 0);
+		if (state->sq_local_tail - __atomic_load_n(state->sq_head,
+				__ATOMIC_ACQUIRE) >= state->sq_entries)
+			return NULL;
+	}
+	idx = state->sq_local_tail & *state->sq_mask;
+	sqe = &state->sqes[idx];
+	memset(sqe, 0, sizeof(*sqe));
+	state->sq_array[idx] = idx;
+	state->sq_local_tail++;
+	state->to_submit++;
+	return sqe;
+}
+
+static int aeUringArm(aeApiState *state, int fd, int mask)
+{
+	struct io_uring_sqe *sqe = aeUringGetSqe(state);
+
+	if (!sqe)
+		return -1;
+	sqe->opcode = IORING_OP_POLL_ADD;
+	sqe->fd = fd;
+	if (mask & AE_READABLE)
+		sqe->poll32_events |= POLLIN;
+	if (mask & AE_WRITABLE)
+		sqe->poll32_events |= POLLOUT;
+	sqe->user_data = aeUringPollTag(state, fd);
+	state->armed[fd] = mask;
+	return 0;
+}
+
+static int aeUringDisarm(aeApiState *state, int fd)
+{
+	struct io_uring_sqe *sqe = aeUringGetSqe(state);
+
+	if (!sqe)
+		return -1;
+	sqe->opcode = IORING_OP_POLL_REMOVE;
+	sqe->fd = -1;
+	sqe->addr = aeUringPollTag(state, fd);
+	sqe->user_data = AE_URING_NOTAG;
+	state->gen[fd]++;
+	state->armed[fd] = AE_NONE;
+	return 0;
+}
+
+static void aeUringUnmap(aeApiState *state)
+{
+	if (state->sqes)
+		munmap(state->sqes, state->sqes_sz);
+	if (state->cq_ring && state->cq_ring != state->sq_ring)
+		munmap(state->cq_ring, state->cq_ring_sz);
+	if (state->sq_ring)
+		munmap(state->sq_ring, state->sq_ring_sz);
+}
+
+static int aeUringSetup(aeApiState *state)
+{
+	struct io_uring_params p;
+	char *sq, *cq;
+
+	memset(&p, 0, sizeof(p));
+	state->ringfd = syscall(__NR_io_uring_setup, AE_URING_ENTRIES, &p);
+	if (state->ringfd < 0)
+		return -1;
+	if (!(p.features & IORING_FEAT_EXT_ARG))
+		goto err;
+
+	state->sq_ring_sz = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+	state->cq_ring_sz = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+	if (p.features & IORING_FEAT_SINGLE_MMAP) {
+		if (state->cq_ring_sz > state->sq_ring_sz)
+			state->sq_ring_sz = state->cq_ring_sz;
+		state->cq_ring_sz = state->sq_ring_sz;
+	}
+
+	sq = mmap(NULL, state->sq_ring_sz, PROT_READ | PROT_WRITE,
+		MAP_SHARED | MAP_POPULATE, state->ringfd, IORING_OFF_SQ_RING);
+	if (sq == MAP_FAILED)
+		goto err;
+	state->sq_ring = sq;
+
+	if (p.features & IORING_FEAT_SINGLE_MMAP) {
+		cq = sq;
+	} else {
+		cq = mmap(NULL, state->cq_ring_sz, PROT_READ | PROT_WRITE,
+			MAP_SHARED | MAP_POPULATE, state->ringfd, IORING_OFF_CQ_RING);
+		if (cq == MAP_FAILED)
+			goto err;
+	}
+	state->cq_ring = cq;
+
+	state->sqes_sz = p.sq_entries * sizeof(struct io_uring_sqe);
+	state->sqes = mmap(NULL, state->sqes_sz, PROT_READ | PROT_WRITE,
+		MAP_SHARED | MAP_POPULATE, state->ringfd, IORING_OFF_SQES);
+	if (state->sqes == MAP_FAILED) {
+		state->sqes = NULL;
+		goto err;
+	}
+
+	state->sq_entries = p.sq_entries;
+	state->sq_head = (unsigned *)(sq + p.sq_off.head);
+	state->sq_tail = (unsigned *)(sq + p.sq_off.tail);
+	state->sq_mask = (unsigned *)(sq + p.sq_off.ring_mask);
+	state->sq_array = (unsigned *)(sq + p.sq_off.array);
+	state->sq_local_tail = *state->sq_tail;
+	state->cq_head = (unsigned *)(cq + p.cq_off.head);
+	state->cq_tail = (unsigned *)(cq + p.cq_off.tail);
+	state->cq_mask = (unsigned *)(cq + p.cq_off.ring_mask);
+	state->cqes = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+	return 0;
+err:
+	aeUringUnmap(state);
+	close(state->ringfd);
+	return -1;
+}
+
+static int aeApiCreate(aeEventLoop *eventLoop)
+{
+	aeApiState *state = zmalloc(sizeof(aeApiState));
+
+	if (!state)
+		return -1;
+	memset(state, 0, sizeof(*state));
+	state->setsize = eventLoop->setsize;
+	state->armed = zmalloc(sizeof(int) * state->setsize);
+	state->gen = zmalloc(sizeof(uint32_t) * state->setsize);
+	if (!state->armed || !state->gen || aeUringSetup(state) == -1) {
+		zfree(state->armed);
+		zfree(state->gen);
+		zfree(state);
+		return -1;
+	}
+	memset(state->armed, 0, sizeof(int) * state->setsize);
+	memset(state->gen, 0, sizeof(uint32_t) * state->setsize);
+	eventLoop->apidata = state;
+	return 0;
+}
+
+static int aeApiResize(aeEventLoop *eventLoop, int setsize)
+{
+	aeApiState *state = eventLoop->apidata;
+	void *armed, *gen;
+
+	if (setsize <= state->setsize)
+		return 0;
+
+	if (!(armed = zrealloc(state->armed, sizeof(int) * setsize)))
+		return -1;
+	state->armed = armed;
+	if (!(gen = zrealloc(state->gen, sizeof(uint32_t) * setsize)))
+		return -1;
+	state->gen = gen;
+
+	memset(state->armed + state->setsize, 0,
+		sizeof(int) * (setsize - state->setsize));
+	memset(state->gen + state->setsize, 0,
+		sizeof(uint32_t) * (setsize - state->setsize));
+	state->setsize = setsize;
+	return 0;
+}
+
+static void aeApiFree(aeEventLoop *eventLoop)
+{
+	aeApiState *state = eventLoop->apidata;
+
+	aeUringUnmap(state);
+	/* the kernel lets go of the buffers with the ring */
+	close(state->ringfd);
+	zfree(state->iobufs);
+	zfree(state->armed);
+	zfree(state->gen);
+	zfree(state);
+}
+
+static int aeApiAddEvent(aeEventLoop *eventLoop, int fd, int mask)
+{
+	aeApiState *state = eventLoop->apidata;
+
+	mask |= aeFileEventOf(eventLoop, fd)->mask;	/* Merge old events */
+	if (state->armed[fd] == mask)
+		return 0;
+	if (state->armed[fd] != AE_NONE && aeUringDisarm(state, fd) == -1)
+		return -1;
+	return aeUringArm(state, fd, mask);
+}
+
+static void aeApiDelEvent(aeEventLoop *eventLoop, int fd, int delmask)
+{
+	aeApiState *state = eventLoop->apidata;
+	int mask = aeFileEventOf(eventLoop, fd)->mask & (~delmask);
+
+	/* a fd that just completed is not armed, the re-arm pass in
+	 * aeApiPoll() picks up whatever mask is left */
+	if (state->armed[fd] == AE_NONE || state->armed[fd] == mask)
+		return;
+	if (aeUringDisarm(state, fd) == -1)
+		return;
+	if (mask != AE_NONE)
+		aeUringArm(state, fd, mask);
+}
+
+static int aeApiPoll(aeEventLoop *eventLoop, struct timeval *tvp)
+{
+	aeApiState *state = eventLoop->apidata;
+	struct io_uring_getevents_arg arg;
+	struct __kernel_timespec ts;
+	unsigned head, tail, wait_nr;
+	int j, numevents = 0;
+
+	/* poll again the fds reported last time that are still registered */
+	for (j = 0; j < state->nrearm; j++) {
+		int fd = state->rearm[j];
+		aeFileEvent *fe = aeFileEventOf(eventLoop, fd);
+
+		if (fe && fd < state->setsize && state->armed[fd] == AE_NONE
+			&& fe->mask != AE_NONE)
+			aeUringArm(state, fd, fe->mask);
+	}
+	state->nrearm = 0;
+
+	memset(&arg, 0, sizeof(arg));
+	if (tvp) {
+		ts.tv_sec = tvp->tv_sec;
+		ts.tv_nsec = tvp->tv_usec * 1000;
+		arg.ts = (uint64_t)(uintptr_t)&ts;
+	}
+	/* completions left over from the last harvest: just submit */
+	head = *state->cq_head;
+	tail = __atomic_load_n(state->cq_tail, __ATOMIC_ACQUIRE);
+	wait_nr = (head == tail) ? 1 : 0;
+	aeUringEnter(state, wait_nr, IORING_ENTER_GETEVENTS | IORING_ENTER_EXT_ARG,
+		&arg, sizeof(arg));
+
+	tail = __atomic_load_n(state->cq_tail, __ATOMIC_ACQUIRE);
+	while (head != tail && state->nrearm < MAX_FIRED_EVENTS
+		&& state->ndone < MAX_FIRED_EVENTS) {
+		struct io_uring_cqe *cqe = &state->cqes[head & *state->cq_mask];
+		uint64_t ud = cqe->user_data;
+		int fd = (int)(uint32_t)ud;
+		int mask = 0;
+
+		head++;
+		if (ud == AE_URING_NOTAG)
+			continue;
+		if (ud & AE_URING_IO) {
+			aeIo *io = (aeIo *)(uintptr_t)(ud & ~AE_URING_IO);
+
+			io->buf = NULL;
+			if (cqe->flags & IORING_CQE_F_BUFFER)
+				io->buf = state->iobufs + state->iobuf_size
+					* (cqe->flags >> IORING_CQE_BUFFER_SHIFT);
+			state->done[state->ndone].io = io;
+			state->done[state->ndone].res = cqe->res;
+			state->ndone++;
+			continue;
+		}
+		if (fd >= state->setsize
+			|| (uint32_t)(ud >> 32) != (state->gen[fd] & AE_URING_GEN_MASK))
+			continue;	/* removed or superseded poll */
+
+		state->armed[fd] = AE_NONE;
+		state->rearm[state->nrearm++] = fd;
+		if (cqe->res < 0)
+			continue;
+		if (cqe->res & POLLIN)
+			mask |= AE_READABLE;
+		if (cqe->res & POLLOUT)
+			mask |= AE_WRITABLE;
+		if (cqe->res & POLLERR)
+			mask |= AE_READABLE | AE_WRITABLE;
+		if (cqe->res & POLLHUP)
+			mask |= AE_WRITABLE;
+		eventLoop->fired[numevents].fd = fd;
+		eventLoop->fired[numevents].mask = mask;
+		numevents++;
+	}
+	__atomic_store_n(state->cq_head, head, __ATOMIC_RELEASE);
+	if (state->nrearm == MAX_FIRED_EVENTS || state->ndone == MAX_FIRED_EVENTS)
+		eventLoop->pollFull++;
+	eventLoop->ioDone = state->ndone;
+	return numevents;
+}
+
+/* Take the aeIo completions harvested by aeApiPoll(), returns how many.
+ * aeProcessEvents() runs them through aeApiIoDone(), like aeApiFired(). */
+static int aeApiIoReap(aeEventLoop *eventLoop)
+{
+	aeApiState *state = eventLoop->apidata;
+	int n = state->ndone;
+
+	state->ndone = 0;
+	eventLoop->ioDone = 0;
+	return n;
+}
+
+/* The j-th reaped completion, no longer pending */
+static inline aeIo *aeApiIoDone(aeEventLoop *eventLoop, int j, int *res)
+{
+	aeApiState *state = eventLoop->apidata;
+	aeIo *io = state->done[j].io;
+
+	*res = state->done[j].res;
+	io->pending = 0;
+	eventLoop->ioPending--;
+	return io;
+}
+
+static int aeUringSubmitIo(aeEventLoop *eventLoop, aeIo *io, int opcode,
+		int fd, const void *addr, size_t len)
+{
+	aeApiState *state = eventLoop->apidata;
+	struct io_uring_sqe *sqe;
+
+	if (!addr && !state->iobufs)
+		return -1;
+	if (!(sqe = aeUringGetSqe(state)))
+		return -1;
+	sqe->opcode = opcode;
+	sqe->fd = fd;
+	sqe->addr = (uint64_t)(uintptr_t)addr;
+	sqe->len = len;
+	sqe->msg_flags = MSG_NOSIGNAL;
+	if (!addr) {
+		/* the kernel picks the buffer when data is there */
+		sqe->flags |= IOSQE_BUFFER_SELECT;
+		sqe->buf_group = AE_URING_BGID;
+		if (sqe->len > state->iobuf_size)
+			sqe->len = state->iobuf_size;
+	}
+	sqe->user_data = (uint64_t)(uintptr_t)io | AE_URING_IO;
+	io->pending = 1;
+	eventLoop->ioPending++;
+	return 0;
+}
+
+/* buf NULL receives into one of the aeSetIoBuffers() set */
+static int aeApiSubmitRecv(aeEventLoop *eventLoop, aeIo *io, int fd,
+		char *buf, size_t len)
+{
+	return aeUringSubmitIo(eventLoop, io, IORING_OP_RECV, fd, buf, len);
+}
+
+static int aeApiSubmitSend(aeEventLoop *eventLoop, aeIo *io, int fd,
+		const struct msghdr *msg)
+{
+	return aeUringSubmitIo(eventLoop, io, IORING_OP_SENDMSG, fd, msg, 1);
+}
+
+static int aeApiCancelIo(aeEventLoop *eventLoop, aeIo *io)
+{
+	aeApiState *state = eventLoop->apidata;
+	struct io_uring_sqe *sqe = aeUringGetSqe(state);
+
+	if (!sqe)
+		return -1;
+	sqe->opcode = IORING_OP_ASYNC_CANCEL;
+	sqe->fd = -1;
+	sqe->addr = (uint64_t)(uintptr_t)io | AE_URING_IO;
+	sqe->user_data = AE_URING_NOTAG;
+	return 0;
+}
+
+/* hand count buffers from addr on to the kernel, ids from bid */
+static int aeUringProvide(aeApiState *state, char *addr, int count, int bid)
+{
+	struct io_uring_sqe *sqe = aeUringGetSqe(state);
+
+	if (!sqe)
+		return -1;
+	sqe->opcode = IORING_OP_PROVIDE_BUFFERS;
+	sqe->fd = count;
+	sqe->addr = (uint64_t)(uintptr_t)addr;
+	sqe->len = state->iobuf_size;
+	sqe->buf_group = AE_URING_BGID;
+	sqe->off = bid;
+	sqe->user_data = AE_URING_NOTAG;
+	return 0;
+}
+
+static int aeApiSetIoBuffers(aeEventLoop *eventLoop, int count, size_t size)
+{
+	aeApiState *state = eventLoop->apidata;
+
+	/* buffer ids are 16 bit */
+	if (state->iobufs || count <= 0 || count > 65536 || !size
+		|| size > INT32_MAX)
+		return -1;
+	if (!(state->iobufs = zmalloc(count * size)))
+		return -1;
+	state->iobuf_size = size;
+	if (aeUringProvide(state, state->iobufs, count, 0) == -1) {
+		zfree(state->iobufs);
+		state->iobufs = NULL;
+		return -1;
+	}
+	return 0;
+}
+
+static void aeApiReleaseIoBuffer(aeEventLoop *eventLoop, char *buf)
+{
+	aeApiState *state = eventLoop->apidata;
+
+	aeUringProvide(state, buf, 1, (buf - state->iobufs) / state->iobuf_size);
+}
+
+static char *aeApiName(void)
+{
+	return "io_uring";
+}
+
+#endif				/* __AE_URING__ */
@@ -0,0 +1,152 @@
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#include <string.h>
+
+#include "conn.h"
+#include "codec.h"
+
+int codec_init_length(codec *codec, int len_bytes, long len_adjust,
+		size_t max_frame)
+{
+	if (len_bytes != 1 && len_bytes != 2 && len_bytes != 4 && len_bytes != 8)
+		return -1;
+	memset(codec, 0, sizeof(*codec));
+	codec->type = CODEC_LENGTH;
+	codec->len_bytes = len_bytes;
+	codec->len_adjust = len_adjust;
+	codec->max_frame = max_frame;
+	return 0;
+}
+
+int codec_init_delim(codec *codec, const char *delim, size_t delim_len,
+		size_t max_frame)
+{
+	if (!delim || !delim_len)
+		return -1;
+	memset(codec, 0, sizeof(*codec));
+	codec->type = CODEC_DELIM;
+	codec->delim = delim;
+	codec->delim_len = delim_len;
+	codec->max_frame = max_frame;
+	return 0;
+}
+
+int codec_init_header(codec *codec, size_t header_len,
+		codec_body_len_proc *body_len, size_t max_frame)
+{
+	if (!header_len || !body_len)
+		return -1;
+	memset(codec, 0, sizeof(*codec));
+	codec->type = CODEC_HEADER;
+	codec->header_len = header_len;
+	codec->body_len = body_len;
+	codec->max_frame = max_frame;
+	return 0;
+}
+
+/* the whole frame size once its header is complete, 0 before, -1 if
+ * the frame is rejected */
+static ssize_t codec_frame_size(const codec *c, const char *buf, size_t len)
+{
+	unsigned long long v = 0;
+	long long body;
+	int i;
+
+	if (c->type == CODEC_LENGTH) {
+		if (len < (size_t)c->len_bytes)
+			return 0;
+		for (i = 0; i < c->len_bytes; i++)
+			v = v << 8 | (unsigned char)buf[i];
+		body = (long long)v + c->len_adjust;
+		if (body < 0 || (c->max_frame && (unsigned long long)body > c->max_frame))
+			return -1;
+		return c->len_bytes + body;
+	}
+
+	if (len < c->header_len)
+		return 0;
+	if ((body = c->body_len(buf, c->header_len)) < 0
+		|| (c->max_frame && (size_t)body > c->max_frame))
+		return -1;
+	return c->header_len + body;
+}
+
+/*
+ * Find the frame at the start of buf. Returns 1 with the part to hand
+ * out at buf + *off, *blen bytes, and the bytes to consume in *frame;
+ * 0 when more input is needed, -1 on a frame the codec rejects.
+ */
+static int codec_next(struct conn *conn, const char *buf, size_t len,
+		size_t *off, size_t *blen, size_t *frame)
+{
+	const codec *c = conn->codec;
+	const char *p = NULL;
+	ssize_t size;
+
+	if (c->type == CODEC_DELIM) {
+		if (len >= c->delim_len)
+			p = memmem(buf + conn->codec_scan, len - conn->codec_scan,
+					c->delim, c->delim_len);
+		if (!p) {
+			/* a delimiter may straddle the end, keep its head */
+			if (len >= c->delim_len)
+				conn->codec_scan = len - c->delim_len + 1;
+			return (c->max_frame && conn->codec_scan > c->max_frame) ? -1 : 0;
+		}
+		conn->codec_scan = 0;
+		*off = 0;
+		*blen = p - buf;
+		*frame = *blen + c->delim_len;
+		return (c->max_frame && *blen > c->max_frame) ? -1 : 1;
+	}
+
+	/* the header is parsed once per frame, not on every read */
+	if (!conn->codec_need) {
+		if ((size = codec_frame_size(c, buf, len)) <= 0)
+			return size;
+		conn->codec_need = size;
+	}
+	if (len < conn->codec_need)
+		return 0;
+	*frame = conn->codec_need;
+	*off = c->type == CODEC_LENGTH ? (size_t)c->len_bytes : 0;
+	*blen = *frame - *off;
+	conn->codec_need = 0;
+	return 1;
+}
+
+static void codec_on_message(struct conn *conn)
+{
+	const char *buf;
+	size_t len, off = 0, blen = 0, frame = 0;
+	int ret = 0;
+
+	for (;;) {
+		conn->get_message(conn, &buf, &len);
+		if ((ret = codec_next(conn, buf, len, &off, &blen, &frame)) <= 0)
+			break;
+		/* a codec not set up by codec_init_*() could consume nothing */
+		if (!frame) {
+			ret = -1;
+			break;
+		}
+		conn->on_frame(conn, buf + off, blen);
+		if (conn->flags & CONN_CLOSED)
+			return;
+		conn->use_message(conn, frame);
+	}
+	if (ret < 0)
+		conn->on_error(conn);
+}
+
+void conn_set_codec(struct conn *conn, const codec *codec,
+		codec_frame_proc *on_frame)
+{
+	conn->codec = codec;
+	conn->codec_scan = 0;
+	conn->codec_need = 0;
+	conn->on_frame = on_frame;
+	conn->on_message = codec_on_message;
+}
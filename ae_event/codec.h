@@ -0,0 +1,56 @@
+#ifndef __CODEC_H__
+#define __CODEC_H__
+
+#include <stddef.h>
+#include <sys/types.h>
+
+#include "conn.h"
+
+/*
+ * Frame decoding for conn. A codec describes how frames are delimited
+ * on the wire; once set on a conn, every complete frame in the inbuf is
+ * handed to on_frame() as a view into the inbuf (valid until the
+ * callback returns) and consumed afterwards. The conn remembers how far
+ * a partial frame was parsed, so bytes are never scanned twice.
+ *
+ * A codec holds no per-conn state and can be shared by many conns.
+ */
+
+enum codec_type {
+	CODEC_LENGTH,	/* big-endian length prefix, then the body */
+	CODEC_DELIM,	/* body terminated by a delimiter */
+	CODEC_HEADER,	/* fixed-size header that tells the body size */
+};
+
+/* body size from a CODEC_HEADER header, -1 if the header is invalid */
+typedef ssize_t codec_body_len_proc(const char *header, size_t len);
+
+typedef void codec_frame_proc(struct conn *conn, const char *frame, size_t len);
+
+typedef struct codec {
+	enum codec_type type;
+	size_t max_frame;	/* longer frames fail the conn, 0 = no limit */
+	int len_bytes;	/* CODEC_LENGTH: 1, 2, 4 or 8 */
+	long len_adjust;	/* CODEC_LENGTH: added to the prefix value */
+	const char *delim;	/* CODEC_DELIM */
+	size_t delim_len;
+	size_t header_len;	/* CODEC_HEADER */
+	codec_body_len_proc *body_len;
+} codec;
+
+/* on_frame() gets the body, without prefix or delimiter. CODEC_HEADER
+ * frames are passed whole, header included. The init functions return
+ * -1 on a codec that could produce empty frames: a length prefix not
+ * 1, 2, 4 or 8 bytes wide, an empty delimiter or an empty header. */
+int codec_init_length(codec *codec, int len_bytes, long len_adjust,
+		size_t max_frame);
+int codec_init_delim(codec *codec, const char *delim, size_t delim_len,
+		size_t max_frame);
+int codec_init_header(codec *codec, size_t header_len,
+		codec_body_len_proc *body_len, size_t max_frame);
+
+/* Decode the conn's input with codec, replacing on_message. */
+void conn_set_codec(struct conn *conn, const codec *codec,
+		codec_frame_proc *on_frame);
+
+#endif
@@ -1,29 +1,351 @@
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
 #include <stdlib.h>
+#include <string.h>
 #include <unistd.h>
 #include <errno.h>
+#include <limits.h>
 #include <stdbool.h>
+#include <sys/uio.h>
+#include <sys/stat.h>
+#include <sys/sendfile.h>
+#include <fcntl.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <linux/errqueue.h>
 
 #include "ae.h"
 #include "ez_buffer.h"
+#include "ez_chain.h"
 #include "conn.h"
 #include "debug.h"
 
+#ifndef IOV_MAX
+#define IOV_MAX	1024	/* Linux UIO_MAXIOV */
+#endif
+
+#if defined(MSG_ZEROCOPY) && defined(SO_ZEROCOPY) && defined(SO_EE_ORIGIN_ZEROCOPY)
+#define CONN_HAVE_ZEROCOPY
+#endif
+
+/* buffers that grew past this are not worth keeping in the pool */
+#define CONN_POOL_MAX_BUFFER	(16 * 1024)
+
+/* a closed conn with zerocopy sends in flight polls for their
+ * completions this often, for at most CONN_ZC_LINGER_MS */
+#define CONN_ZC_REAP_MS	10
+#define CONN_ZC_LINGER_MS	(10 * 1000)
+
+/* completion mode: receive buffers handed to the kernel per loop, and
+ * outbuf segments per submitted send */
+#define CONN_RING_BUFS	256
+#define CONN_RING_BUF_SIZE	(16 * 1024)
+#define CONN_RING_IOV	64
+
+struct conn_ring {
+	aeIo rio;
+	aeIo wio;
+	struct msghdr msg;
+	struct iovec iov[CONN_RING_IOV];
+};
+
+/* conn state shared by every conn of one loop, el->connLoop */
+struct conn_loop {
+	/* pool of free conns, off while high_water is 0 */
+	conn *free;
+	unsigned int nfree;
+	unsigned int high_water;
+	unsigned long long hits;
+	unsigned long long misses;
+	/* receive buffer for CONN_SHARED_RBUF conns, CONN_READ_MAX bytes */
+	char *rbuf;
+	/* outbuf bytes in memory over all conns, capped at out_cap */
+	size_t out_bytes;
+	size_t out_cap;
+	unsigned long long out_shed;
+	/* closed conns whose zerocopy pages the kernel still holds */
+	conn *zc_linger;
+	/* CONN_DIRTY conns, flushed by conn_before_sleep() */
+	conn *dirty;
+	/* CONN_RING buffers given to the loop: 1, -1 if that failed */
+	int ring_bufs;
+};
+
+static struct conn_loop *conn_loop_get(aeEventLoop *el)
+{
+	if (!el->connLoop)
+		el->connLoop = calloc(1, sizeof(struct conn_loop));
+	return el->connLoop;
+}
+
+static void conn_release_memory(conn *conn)
+{
+	free(conn->ring);
+	ez_chain_free(&conn->zc_pinned);
+	ez_chain_free(&conn->outbuf);
+	ez_buffer_free(&conn->inbuf);
+	free(conn);
+}
+
+/* keep the buffer storage for the next user, or drop it if it grew */
+static bool conn_pool_recycle(ez_buffer *buf)
+{
+	if (buf->buffer_size > CONN_POOL_MAX_BUFFER) {
+		ez_buffer_free(buf);
+		return ez_buffer_init(buf);
+	}
+	reset_buffer(buf);
+	return true;
+}
+
+static void conn_dirty_unlink(conn *conn)
+{
+	if (conn->dirty_next)
+		conn->dirty_next->dirty_pprev = conn->dirty_pprev;
+	*conn->dirty_pprev = conn->dirty_next;
+	conn->flags &= ~CONN_DIRTY;
+}
+
+static int conn_zc_reap(struct conn *conn);
+
+/* close the socket and release or pool the memory */
+static void conn_destroy_now(conn *conn)
+{
+	struct conn_loop *loop = conn->el->connLoop;
+
+	close(conn->sfd);
+	if (conn->on_free)
+		conn->on_free(conn, conn->free_arg);
+	if (conn->owner_free)
+		conn->owner_free(conn, conn->owner_arg);
+	free(conn->ring);
+	conn->ring = NULL;
+	loop->out_bytes -= conn->outbuf.mem_length;
+	if (loop->nfree < loop->high_water
+		&& conn_pool_recycle(&conn->inbuf)) {
+		/* the segments go back to the thread's cache */
+		ez_chain_free(&conn->zc_pinned);
+		ez_chain_free(&conn->outbuf);
+		conn->pool_next = loop->free;
+		loop->free = conn;
+		loop->nfree++;
+		return;
+	}
+	conn_release_memory(conn);
+}
+
+static void conn_zc_finish(conn *conn)
+{
+	struct conn_loop *loop = conn->el->connLoop;
+	struct conn **pp;
+
+	for (pp = &loop->zc_linger; *pp != conn; pp = &(*pp)->pool_next)
+		;
+	*pp = conn->pool_next;
+	conn->pool_next = NULL;
+	if (conn->zc_next != conn->zc_done) {
+		/* drop the send queue with a RST, the pages are free after */
+		struct linger lg = { 1, 0 };
+
+		setsockopt(conn->sfd, SOL_SOCKET, SO_LINGER, &lg, sizeof(lg));
+	}
+	conn_destroy_now(conn);
+}
+
+static int conn_zc_linger_timer(aeEventLoop *el, void *clientData)
+{
+	struct conn *conn = (struct conn *)clientData;
+
+	if (conn_zc_reap(conn) == 0 && conn->zc_next != conn->zc_done
+		&& el->now < conn->zc_linger_until)
+		return CONN_ZC_REAP_MS;
+	conn->timer_id = NULL;
+	conn_zc_finish(conn);
+	return AE_NOMORE;
+}
+
+/*
+ * The kernel may still read the pinned segments of a closed conn: keep
+ * the socket and the segments until every completion is reaped, or
+ * reset the connection if they take too long. Returns false if the
+ * conn can be destroyed right away.
+ */
+static bool conn_zc_linger(conn *conn)
+{
+	struct conn_loop *loop = conn->el->connLoop;
+
+	if (conn->zc_next == conn->zc_done || conn_zc_reap(conn) < 0
+		|| conn->zc_next == conn->zc_done)
+		return false;
+	/* unsent output is not referenced by the kernel */
+	loop->out_bytes -= conn->outbuf.mem_length;
+	ez_chain_free(&conn->outbuf);
+	shutdown(conn->sfd, SHUT_WR);
+	conn->zc_linger_until = conn->el->now + CONN_ZC_LINGER_MS * 1000LL;
+	if (aeCreateTimeEvent(conn->el, CONN_ZC_REAP_MS, &conn->timer,
+			conn_zc_linger_timer, conn) == AE_ERR)
+		return false;
+	conn->timer_id = &conn->timer;
+	conn->pool_next = loop->zc_linger;
+	loop->zc_linger = conn;
+	return true;
+}
+
+static void conn_destroy(conn *conn)
+{
+	if (conn->flags & CONN_DIRTY)
+		conn_dirty_unlink(conn);
+	if (conn_zc_linger(conn))
+		return;
+	if (conn->zc_next != conn->zc_done) {
+		/* could not wait, do not let the pages be reused while sent */
+		struct linger lg = { 1, 0 };
+
+		setsockopt(conn->sfd, SOL_SOCKET, SO_LINGER, &lg, sizeof(lg));
+	}
+	conn_destroy_now(conn);
+}
+
+int conn_pool_create(aeEventLoop *el, unsigned int high_water)
+{
+	struct conn_loop *loop = conn_loop_get(el);
+
+	if (!loop)
+		return AE_ERR;
+	loop->high_water = high_water;
+	/* a lowered mark takes effect right away */
+	while (loop->nfree > loop->high_water) {
+		conn *conn = loop->free;
+
+		loop->free = conn->pool_next;
+		loop->nfree--;
+		conn_release_memory(conn);
+	}
+	return AE_OK;
+}
+
+/* Free the cached conns and stop pooling. Live conns are freed normally
+ * when they close. */
+void conn_pool_destroy(aeEventLoop *el)
+{
+	if (el->connLoop)
+		conn_pool_create(el, 0);
+}
+
+/* Free the per-loop conn state. Call it before aeDeleteEventLoop(),
+ * once the loop's conns are gone. */
+void conn_loop_free(aeEventLoop *el)
+{
+	struct conn_loop *loop = el->connLoop;
+
+	if (!loop)
+		return;
+	while (loop->zc_linger) {
+		aeDeleteTimeEvent(el, &loop->zc_linger->timer);
+		conn_zc_finish(loop->zc_linger);
+	}
+	conn_pool_destroy(el);
+	free(loop->rbuf);
+	free(loop);
+	el->connLoop = NULL;
+}
+
+void conn_pool_get_stats(aeEventLoop *el, struct conn_pool_stats *stats)
+{
+	struct conn_loop *loop = el->connLoop;
+
+	memset(stats, 0, sizeof(*stats));
+	if (!loop)
+		return;
+	stats->cached = loop->nfree;
+	stats->high_water = loop->high_water;
+	stats->hits = loop->hits;
+	stats->misses = loop->misses;
+}
+
+static conn *conn_alloc(aeEventLoop *el)
+{
+	struct conn_loop *loop = conn_loop_get(el);
+	conn *conn;
+
+	if (!loop)
+		return NULL;
+	if ((conn = loop->free)) {
+		loop->free = conn->pool_next;
+		loop->nfree--;
+		loop->hits++;
+		return conn;
+	}
+	if (loop->high_water)
+		loop->misses++;
+	if (!(conn = malloc(sizeof(*conn))))
+		return NULL;
+	if (!ez_buffer_init(&conn->inbuf)) {
+		free(conn);
+		return NULL;
+	}
+	ez_chain_init(&conn->outbuf);
+	ez_chain_init(&conn->zc_pinned);
+	return conn;
+}
+
+/*
+ * Unregister the conn from its loop right away. When called from a
+ * callback below handle_read() the memory and the socket are released
+ * by conn_release() once the handler unwinds, for a CONN_RING conn once
+ * its cancelled requests have completed.
+ */
 void conn_free(conn *conn)
 {
-	if (!conn)
+	if (!conn || (conn->flags & CONN_CLOSED))
 		return;
 	if (conn->mask & AE_READABLE)
 		aeDeleteFileEvent(conn->el, conn->sfd, AE_READABLE);
 	if (conn->mask & AE_WRITABLE)
 		aeDeleteFileEvent(conn->el, conn->sfd, AE_WRITABLE);
-	close(conn->sfd);
-	ez_buffer_free(&conn->outbuf);
-	ez_buffer_free(&conn->inbuf);
+	conn->mask = AE_NONE;
+	if (conn->ring) {
+		aeCancelIo(conn->el, &conn->ring->rio);
+		aeCancelIo(conn->el, &conn->ring->wio);
+	}
 	if (conn->timer_id != NULL)
 		aeDeleteTimeEvent(conn->el, conn->timer_id);
-	free(conn);
+	conn->flags |= CONN_CLOSED;
+	if (!conn->refs)
+		conn_destroy(conn);
 }
 
+static inline void conn_hold(conn *conn)
+{
+	conn->refs++;
+}
+
+/* return true if the conn was destroyed */
+static inline bool conn_release(conn *conn)
+{
+	if (--conn->refs == 0 && (conn->flags & CONN_CLOSED)) {
+		conn_destroy(conn);
+		return true;
+	}
+	return false;
+}
+
+/* end of a call that may run on_high_watermark() or on_drain(): -1 if
+ * one of them freed the conn */
+static inline int conn_release_ret(conn *conn, int ret)
+{
+	if (conn_release(conn) || (conn->flags & CONN_CLOSED))
+		return -1;
+	return ret;
+}
+
+static int handle_write(aeEventLoop *el, int fd, void *privdata, int mask);
+static void conn_deadline_arm(struct conn *conn);
+static int conn_ring_send(struct conn *conn);
+static ssize_t conn_flush_out(struct conn *conn);
+
 static void default_on_error(conn *conn)
 {
 	TRACE
@@ -33,7 +355,7 @@ static void default_on_error(conn *conn)
 static void default_on_close(conn *conn, int sync_write)
 {
 	if (sync_write) {
-		if (!get_buffer_length(&conn->outbuf)) {
+		if (!ez_chain_length(&conn->outbuf)) {
 			conn_free(conn);  //already send finished
                   	return;
           	}
@@ -52,6 +374,11 @@ static void default_on_close(conn *conn, int sync_write)
 		conn_free(conn);
 }
 
+static void default_on_timeout(conn *conn, int why)
+{
+	conn_free(conn);
+}
+
 static bool default_use_message(conn *conn, size_t len)
 {
 	return erase_buffer(&conn->inbuf, len);
@@ -62,64 +389,409 @@ static void default_get_message(conn *conn, const char **buf, size_t *len)
 	get_buffer_begin(&conn->inbuf, buf, len);
 }
 
+/*
+ * Adapt the read size to the traffic: a read that fills it doubles it,
+ * two reads in a row that use less than half of it halve it.
+ */
+static void conn_read_adapt(struct conn *conn, size_t got)
+{
+	if (got >= conn->read_size) {
+		conn->read_small = 0;
+		if (conn->read_size < CONN_READ_MAX)
+			conn->read_size <<= 1;
+	} else if (got <= conn->read_size / 2) {
+		if (++conn->read_small >= 2 && conn->read_size > CONN_READ_MIN) {
+			conn->read_size >>= 1;
+			conn->read_small = 0;
+		}
+	} else {
+		conn->read_small = 0;
+	}
+}
+
+/* an inbuf that owns no memory, reserve_space() allocates on demand */
+static void conn_inbuf_drop(struct conn *conn)
+{
+	ez_buffer_free(&conn->inbuf);
+	conn->inbuf.buffer_size = 0;
+	conn->inbuf.read_index = conn->inbuf.write_index = 0;
+}
+
+/* the loop's receive buffer when the conn may borrow it right now */
+static char *conn_shared_rbuf(struct conn *conn)
+{
+	struct conn_loop *loop = conn->el->connLoop;
+
+	if (!(conn->flags & CONN_SHARED_RBUF) || get_buffer_length(&conn->inbuf)
+		|| !loop || !loop->rbuf)
+		return NULL;
+	if (conn->inbuf.buffer_base)
+		conn_inbuf_drop(conn);
+	return loop->rbuf;
+}
+
+/* after on_message(): copy what was not consumed out of the shared buffer */
+static bool conn_inbuf_unshare(struct conn *conn)
+{
+	ez_buffer view = conn->inbuf;
+
+	conn->inbuf.buffer_base = NULL;
+	conn_inbuf_drop(conn);
+	if (view.write_index == view.read_index)
+		return true;
+	return append_buffer(&conn->inbuf, view.buffer_base + view.read_index,
+			view.write_index - view.read_index);
+}
+
+/*
+ * Level-triggered conns read until a read comes back short or
+ * read_budget bytes were taken, so one busy conn cannot hold the loop.
+ * With CONN_EDGE the socket is drained until EAGAIN because the
+ * readiness will not be reported again for data that is already queued.
+ *
+ * A CONN_SHARED_RBUF conn with an empty inbuf reads into the loop's
+ * shared buffer, on_message() sees it as the inbuf and only the bytes
+ * left unconsumed are copied to memory of the conn's own.
+ */
 int handle_read(aeEventLoop *el, int fd, void *privdata, int mask)
 {
-    	char *buf;
-    	size_t len;
+	char *buf;
+	size_t len;
+	ssize_t ret;
+	int total = 0;
 	struct conn *conn = (struct conn *)privdata;
 	TRACE
 
-	reserve_space(&conn->inbuf, 512);
-   	get_space_begin(&conn->inbuf, &buf, &len);
-    	int ret = read(conn->sfd, buf, len);
-   	if (ret < 0) {
-        	if (errno != EINTR && errno != EAGAIN && errno != EWOULDBLOCK) {
-            		conn->on_error(conn);
-			return -1;
-        	}
-        	return 0;
-    	} else if (ret == 0) {
-        	conn->on_close(conn, 0); //peer closed
+	conn_hold(conn);
+	/* the error queue is reported as readable */
+	if (conn->zc_next != conn->zc_done && conn_zc_reap(conn) < 0) {
+		conn->on_error(conn);
+		conn_release(conn);
 		return -1;
-    	} else {
-        	append_buffer_ex(&conn->inbuf, ret);
-        	conn->on_message(conn); //callback
 	}
-	return ret;
+	for (;;) {
+		char *shared = conn_shared_rbuf(conn);
+
+		if (shared) {
+			buf = shared;
+			len = conn->read_size;
+		} else {
+			if (!reserve_space(&conn->inbuf, conn->read_size)) {
+				conn->on_error(conn);
+				total = -1;
+				break;
+			}
+			get_space_begin(&conn->inbuf, &buf, &len);
+		}
+		ret = read(conn->sfd, buf, len);
+		if (ret < 0) {
+			if (errno == EINTR)
+				continue;
+			if (errno != EAGAIN && errno != EWOULDBLOCK) {
+				conn->on_error(conn);
+				total = -1;
+			}
+			break;
+		} else if (ret == 0) {
+			conn->on_close(conn, 0); //peer closed
+			total = -1;
+			break;
+		}
+		conn_read_adapt(conn, ret);
+		conn->last_read = el->now;
+		if (shared) {
+			conn->inbuf.buffer_base = shared;
+			conn->inbuf.buffer_size = CONN_READ_MAX;
+			conn->inbuf.read_index = 0;
+			conn->inbuf.write_index = ret;
+		} else {
+			append_buffer_ex(&conn->inbuf, ret);
+		}
+		total += ret;
+		conn->on_message(conn); //callback
+		if (shared && !conn_inbuf_unshare(conn)) {
+			conn->on_error(conn);
+			total = -1;
+			break;
+		}
+		/* nothing pending, hold no memory until the next message */
+		if ((conn->flags & CONN_SHARED_RBUF) && conn->inbuf.buffer_base
+			&& !get_buffer_length(&conn->inbuf))
+			conn_inbuf_drop(conn);
+		if ((conn->flags & CONN_CLOSED) || !(conn->mask & AE_READABLE))
+			break;
+		if (!(conn->flags & CONN_EDGE)
+			&& ((size_t)ret < len || total >= conn->read_budget))
+			break;
+	}
+	conn_release(conn);
+	return total;
 }
 
-static int handle_write(aeEventLoop *el, int fd, void *privdata, int mask)
+/* send the head file segment with sendfile(), or splice() for a pipe */
+static ssize_t conn_write_file(struct conn *conn, ez_seg *seg, size_t want)
 {
-	struct conn *conn = (struct conn *)privdata;
-	const char *buf;
-        size_t len;
+	off_t off;
 
-       	get_buffer_begin(&conn->outbuf, &buf, &len);
-        int ret = write(conn->sfd, buf, len);
-        if (ret < 0) {
-            	if (errno != EINTR && errno != EAGAIN && errno != EWOULDBLOCK) {
-			conn->on_error(conn);
+	if (seg->flags & EZ_SEG_PIPE)
+		return splice(seg->fd, NULL, conn->sfd, NULL, want,
+				SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+	off = seg->offset + seg->read_index;
+	return sendfile(conn->sfd, seg->fd, &off, want);
+}
+
+/*
+ * Reap MSG_ZEROCOPY completions from the error queue and release the
+ * sent segments the kernel no longer reads. Returns -1 on error.
+ */
+static int conn_zc_reap(struct conn *conn)
+{
+#ifdef CONN_HAVE_ZEROCOPY
+	char control[128];
+	struct msghdr msg;
+	struct cmsghdr *cm;
+	struct sock_extended_err *serr;
+
+	while (conn->zc_next != conn->zc_done) {
+		memset(&msg, 0, sizeof(msg));
+		msg.msg_control = control;
+		msg.msg_controllen = sizeof(control);
+		if (recvmsg(conn->sfd, &msg, MSG_ERRQUEUE) < 0) {
+			if (errno == EINTR)
+				continue;
+			if (errno == EAGAIN || errno == EWOULDBLOCK)
+				break;
 			return -1;
 		}
-            	return 0;
-        } else {
-            	erase_buffer(&conn->outbuf, ret);
-            	if (!get_buffer_length(&conn->outbuf)) {
-			if (conn->conn_status == conn_closing)
-				conn->on_close(conn, 0);
-			else {
-				aeDeleteFileEvent(conn->el, conn->sfd, AE_WRITABLE);
-				conn->mask &= ~AE_WRITABLE;
+		for (cm = CMSG_FIRSTHDR(&msg); cm; cm = CMSG_NXTHDR(&msg, cm)) {
+			if (!(cm->cmsg_level == SOL_IP && cm->cmsg_type == IP_RECVERR)
+				&& !(cm->cmsg_level == SOL_IPV6 && cm->cmsg_type == IPV6_RECVERR))
+				continue;
+			serr = (struct sock_extended_err *)CMSG_DATA(cm);
+			if (serr->ee_errno || serr->ee_origin != SO_EE_ORIGIN_ZEROCOPY)
+				continue;
+			/* the range [ee_info, ee_data] of sends is done */
+			if (serr->ee_code & SO_EE_CODE_ZEROCOPY_COPIED)
+				conn->zc_copied++;
+			if ((int)(serr->ee_data + 1 - conn->zc_done) > 0)
+				conn->zc_done = serr->ee_data + 1;
+		}
+	}
+	ez_chain_release_upto(&conn->zc_pinned, conn->zc_done - 1);
+#endif
+	return 0;
+}
+
+/* writev(), or sendmsg(MSG_ZEROCOPY) when the batch is large enough */
+static ssize_t conn_send_iov(struct conn *conn, struct iovec *iov, int n,
+		size_t want)
+{
+#ifdef CONN_HAVE_ZEROCOPY
+	struct msghdr msg;
+	ssize_t ret;
+
+	if (conn->zc_threshold && want >= conn->zc_threshold) {
+		memset(&msg, 0, sizeof(msg));
+		msg.msg_iov = iov;
+		msg.msg_iovlen = n;
+		if ((ret = sendmsg(conn->sfd, &msg, MSG_ZEROCOPY)) >= 0) {
+			conn->zc_next++;
+			return ret;
+		}
+		/* out of memory to pin pages, copy this one */
+		if (errno != ENOBUFS)
+			return ret;
+	}
+#endif
+	return writev(conn->sfd, iov, n);
+}
+
+/* drop sent bytes, keeping them pinned while zerocopy sends are out */
+static void conn_consume(struct conn *conn, size_t len)
+{
+	if (conn->zc_next != conn->zc_done)
+		ez_chain_consume(&conn->outbuf, len, &conn->zc_pinned,
+				conn->zc_next - 1);
+	else
+		ez_chain_erase(&conn->outbuf, len);
+}
+
+/*
+ * Send as much of the outbuf as the socket takes: memory segments with
+ * writev(), IOV_MAX of them per call, file segments from their fd.
+ * Stops at EAGAIN, or after a short write unless CONN_EDGE.
+ * Returns the bytes written, -1 on error.
+ */
+static ssize_t conn_write_out(struct conn *conn)
+{
+	struct iovec iov[IOV_MAX];
+	ssize_t ret, total = 0;
+	size_t want;
+	ez_seg *seg;
+	int i, n;
+
+	while ((seg = conn->outbuf.head)) {
+		if (seg->fd >= 0) {
+			want = seg->write_index - seg->read_index;
+			ret = conn_write_file(conn, seg, want);
+			if (ret == 0) {
+				/* the file is shorter than what was queued */
+				errno = EIO;
+				return -1;
 			}
+		} else {
+			n = ez_chain_iov(&conn->outbuf, iov, IOV_MAX);
+			for (want = 0, i = 0; i < n; i++)
+				want += iov[i].iov_len;
+			ret = conn_send_iov(conn, iov, n, want);
 		}
-        }
-	return ret;
+		if (ret < 0) {
+			if (errno == EINTR)
+				continue;
+			if (errno != EAGAIN && errno != EWOULDBLOCK)
+				return -1;
+			break;
+		}
+		conn_consume(conn, ret);
+		total += ret;
+		/* a short write means the socket buffer is full */
+		if (!(conn->flags & CONN_EDGE) && ret < want)
+			break;
+	}
+	if (total)
+		conn->last_write = conn->el->now;
+	return total;
 }
 
-static int send_message(struct conn *conn, const char *buf, size_t len)
+/* refuse to buffer len more bytes when the loop is over its cap */
+static bool conn_out_admit(struct conn *conn, size_t len)
+{
+	struct conn_loop *loop = conn->el->connLoop;
+
+	if (loop->out_cap && loop->out_bytes + len > loop->out_cap) {
+		loop->out_shed++;
+		errno = ENOBUFS;
+		return false;
+	}
+	return true;
+}
+
+/* account an outbuf change that started at mem_length before, and
+ * cross the watermarks */
+static void conn_out_update(struct conn *conn, size_t before)
+{
+	struct conn_loop *loop = conn->el->connLoop;
+	size_t len = ez_chain_length(&conn->outbuf);
+
+	loop->out_bytes += conn->outbuf.mem_length - before;
+	if (conn->write_timeout) {
+		/* the write deadline counts from when output starts waiting */
+		if (!len) {
+			conn->flags &= ~CONN_WRITE_WAIT;
+		} else if (!(conn->flags & CONN_WRITE_WAIT)) {
+			conn->flags |= CONN_WRITE_WAIT;
+			conn->last_write = conn->el->now;
+			conn_deadline_arm(conn);
+		}
+	}
+	if (!conn->high_watermark)
+		return;
+	if (!(conn->flags & CONN_HIGH_WATER) && len >= conn->high_watermark) {
+		conn->flags |= CONN_HIGH_WATER;
+		if (conn->on_high_watermark)
+			conn->on_high_watermark(conn);
+	} else if ((conn->flags & CONN_HIGH_WATER) && len <= conn->low_watermark) {
+		conn->flags &= ~CONN_HIGH_WATER;
+		if (conn->on_drain)
+			conn->on_drain(conn);
+	}
+}
+
+static void conn_want_write(struct conn *conn)
+{
+	if (!(conn->mask & AE_WRITABLE)) {
+		aeCreateFileEvent(conn->el, conn->sfd, AE_WRITABLE,
+					handle_write, conn);
+		conn->mask |= AE_WRITABLE;
+	}
+}
+
+/*
+ * With CONN_EDGE AE_WRITABLE stays registered for the life of the conn,
+ * so an empty outbuf is normal here and the interest is never toggled.
+ */
+static int handle_write(aeEventLoop *el, int fd, void *privdata, int mask)
 {
-    	if (get_buffer_length(&conn->outbuf)) {  //have last data
-        	append_buffer(&conn->outbuf, buf, len);
+	struct conn *conn = (struct conn *)privdata;
+	size_t before = conn->outbuf.mem_length;
+	ssize_t total;
+
+	/* on_drain() may free the conn */
+	conn_hold(conn);
+	if (conn_zc_reap(conn) < 0 || (total = conn_write_out(conn)) < 0) {
+		conn_out_update(conn, before);
+		conn->on_error(conn);
+		conn_release(conn);
+		return -1;
+	}
+	conn_out_update(conn, before);
+
+	if (!(conn->flags & CONN_CLOSED) && !ez_chain_length(&conn->outbuf)) {
+		if (conn->conn_status == conn_closing)
+			conn->on_close(conn, 0);
+		else if (!(conn->flags & CONN_EDGE)) {
+			aeDeleteFileEvent(conn->el, conn->sfd, AE_WRITABLE);
+			conn->mask &= ~AE_WRITABLE;
+		}
+	}
+	conn_release(conn);
+	return total;
+}
+
+/* queue the part of a send that the socket did not take; the caller
+ * holds the conn, -1 if a watermark callback freed it */
+static int conn_buffer(struct conn *conn, const char *buf, size_t len)
+{
+	size_t before = conn->outbuf.mem_length;
+	bool ok;
+
+	if (!conn_out_admit(conn, len))
+		return -1;
+	ok = ez_chain_append(&conn->outbuf, buf, len);
+	conn_out_update(conn, before);
+	return ok && !(conn->flags & CONN_CLOSED) ? 0 : -1;
+}
+
+static void conn_mark_dirty(struct conn *conn)
+{
+	struct conn_loop *loop = conn->el->connLoop;
+
+	if (conn->flags & CONN_DIRTY)
+		return;
+	conn->flags |= CONN_DIRTY;
+	conn->dirty_next = loop->dirty;
+	conn->dirty_pprev = &loop->dirty;
+	if (loop->dirty)
+		loop->dirty->dirty_pprev = &conn->dirty_next;
+	loop->dirty = conn;
+}
+
+static int conn_send(struct conn *conn, const char *buf, size_t len)
+{
+	if (conn->flags & CONN_DEFER_FLUSH) {
+		if (conn_buffer(conn, buf, len) < 0)
+			return -1;
+		conn_mark_dirty(conn);
+		return 0;
+	}
+	if (conn->flags & CONN_RING) {
+		if (conn_buffer(conn, buf, len) < 0 || conn_ring_send(conn) < 0)
+			return -1;
+		return 0;
+	}
+    	if (ez_chain_length(&conn->outbuf)) {  //have last data
+        	if (conn_buffer(conn, buf, len) < 0)
+			return -1;
         	return 0;
     	}
 
@@ -131,21 +803,531 @@ static int send_message(struct conn *conn, const char *buf, size_t len)
         	ret = 0;
     	} else if (len == ret) {
 		TRACE
+		conn->last_write = conn->el->now;
             	return ret;
 	}
-    	append_buffer(&conn->outbuf, buf + ret, len - ret);
+    	if (conn_buffer(conn, buf + ret, len - ret) < 0)
+		return -1;
 	
-	if (!(conn->mask & AE_WRITABLE)) {
-		aeCreateFileEvent(conn->el, conn->sfd, AE_WRITABLE,
-					handle_write, conn);
-		conn->mask |= AE_WRITABLE;
-	}
+	conn_want_write(conn);
     	return ret;
 }
 
+static int send_message(struct conn *conn, const char *buf, size_t len)
+{
+	conn_hold(conn);
+	return conn_release_ret(conn, conn_send(conn, buf, len));
+}
+
+/*
+ * Scatter-gather output: conn_queue() copies buf into the outbuf,
+ * conn_queue_ref() links it without copying and calls release(arg) once
+ * it has been sent or the conn is freed. Nothing is written until
+ * conn_flush(), which sends the whole queue with writev().
+ */
+int conn_queue(struct conn *conn, const char *buf, size_t len)
+{
+	conn_hold(conn);
+	return conn_release_ret(conn, conn_buffer(conn, buf, len));
+}
+
+int conn_queue_ref(struct conn *conn, const char *buf, size_t len,
+		ez_release_proc *release, void *arg)
+{
+	size_t before = conn->outbuf.mem_length;
+	bool ok;
+
+	if (!conn_out_admit(conn, len))
+		return -1;
+	conn_hold(conn);
+	ok = ez_chain_append_ref(&conn->outbuf, buf, len, release, arg);
+	conn_out_update(conn, before);
+	return conn_release_ret(conn, ok ? 0 : -1);
+}
+
+static void conn_close_file(void *arg)
+{
+	close((int)(long)arg);
+}
+
+/*
+ * Queue len bytes of fd from off behind whatever is already queued; they
+ * go out with sendfile() as the socket becomes writable, bytes queued
+ * later follow them. A pipe is drained with splice() instead and off is
+ * ignored; it must already hold len bytes. The fd is duplicated, the
+ * caller may close its own right away.
+ */
+int conn_send_file(struct conn *conn, int fd, off_t off, size_t len)
+{
+	struct stat st;
+	int flags = 0, dfd;
+	ssize_t ret;
+
+	if (!len)
+		return 0;
+	if (conn->flags & CONN_RING) {
+		errno = ENOTSUP;
+		return -1;
+	}
+	if (fstat(fd, &st) < 0)
+		return -1;
+	if (S_ISFIFO(st.st_mode))
+		flags |= EZ_SEG_PIPE;
+	if ((dfd = fcntl(fd, F_DUPFD_CLOEXEC, 0)) < 0)
+		return -1;
+	/* file bytes are not held in memory, only the watermarks see them */
+	if (!ez_chain_append_file(&conn->outbuf, dfd, off, len, flags,
+			conn_close_file, (void *)(long)dfd)) {
+		close(dfd);
+		return -1;
+	}
+	conn_hold(conn);
+	conn_out_update(conn, conn->outbuf.mem_length);
+	if (conn->flags & CONN_CLOSED) {
+		ret = -1;
+	} else if (conn->flags & CONN_DEFER_FLUSH) {
+		conn_mark_dirty(conn);
+		ret = 0;
+	} else {
+		ret = conn_flush_out(conn);
+	}
+	return conn_release_ret(conn, ret < 0 ? -1 : 0);
+}
+
+/*
+ * Let the conn read into a receive buffer shared by every conn of the
+ * loop whenever its inbuf is empty, so idle conns hold no inbuf memory.
+ * on_message() must not keep pointers into the inbuf, as always.
+ */
+int conn_set_shared_rbuf(struct conn *conn, int on)
+{
+	struct conn_loop *loop;
+
+	if (!on) {
+		conn->flags &= ~CONN_SHARED_RBUF;
+		return 0;
+	}
+	/* a receive in flight may target the inbuf */
+	if (conn->flags & CONN_RING)
+		return -1;
+	if (!(loop = conn_loop_get(conn->el)))
+		return -1;
+	if (!loop->rbuf && !(loop->rbuf = malloc(CONN_READ_MAX)))
+		return -1;
+	conn->flags |= CONN_SHARED_RBUF;
+	if (!get_buffer_length(&conn->inbuf))
+		conn_inbuf_drop(conn);
+	return 0;
+}
+
+/*
+ * Send batches of at least threshold bytes with MSG_ZEROCOPY (0 turns it
+ * off, CONN_ZEROCOPY_MIN is a sane value). Sent segments stay pinned
+ * until the kernel reports their completion on the error queue, which
+ * handle_read() reaps, so the conn must have it registered. Fails where
+ * the kernel has no SO_ZEROCOPY.
+ */
+int conn_set_zerocopy(struct conn *conn, size_t threshold)
+{
+#ifdef CONN_HAVE_ZEROCOPY
+	int on = 1;
+
+	if (threshold && setsockopt(conn->sfd, SOL_SOCKET, SO_ZEROCOPY,
+			&on, sizeof(on)) < 0)
+		return -1;
+	conn->zc_threshold = threshold;
+	return 0;
+#else
+	errno = ENOTSUP;
+	return threshold ? -1 : 0;
+#endif
+}
+
+static ssize_t conn_flush_out(struct conn *conn)
+{
+	size_t before = conn->outbuf.mem_length;
+	ssize_t ret;
+
+	if (!ez_chain_length(&conn->outbuf))
+		return 0;
+	/* the ring sends it, nothing is written here */
+	if (conn->flags & CONN_RING)
+		return conn_ring_send(conn);
+	/* handle_write() owns the queue while AE_WRITABLE is pending */
+	if ((conn->mask & AE_WRITABLE) && !(conn->flags & CONN_EDGE))
+		return 0;
+	ret = conn_write_out(conn);
+	conn_out_update(conn, before);
+	if (ret < 0 || (conn->flags & CONN_CLOSED))
+		return -1;
+	if (ez_chain_length(&conn->outbuf))
+		conn_want_write(conn);
+	return ret;
+}
+
+/* Write what the socket takes now and leave the rest to handle_write().
+ * Returns the bytes written, -1 on error (on_error is not called) or if
+ * on_drain() freed the conn. */
+int conn_flush(struct conn *conn)
+{
+	conn_hold(conn);
+	return conn_release_ret(conn, conn_flush_out(conn));
+}
+
+static void conn_ring_recv_done(aeEventLoop *el, aeIo *io, int res);
+static void conn_ring_send_done(aeEventLoop *el, aeIo *io, int res);
+
+/*
+ * Submit the next receive: into a loop buffer the kernel takes only
+ * once data arrives, so idle conns hold none, or into the inbuf when it
+ * already holds a partial message or the loop has no buffers to spare.
+ * The request holds a reference on the conn until it completes.
+ */
+static int conn_ring_recv(struct conn *conn, bool own)
+{
+	struct conn_loop *loop = conn->el->connLoop;
+	char *buf = NULL;
+	size_t len = conn->read_size;
+
+	if (own || loop->ring_bufs < 0 || get_buffer_length(&conn->inbuf)) {
+		if (!reserve_space(&conn->inbuf, conn->read_size))
+			return -1;
+		get_space_begin(&conn->inbuf, &buf, &len);
+	}
+	if (aeSubmitRecv(conn->el, &conn->ring->rio, conn->sfd, buf, len) == AE_ERR)
+		return -1;
+	conn_hold(conn);
+	return 0;
+}
+
+static void conn_ring_recv_done(aeEventLoop *el, aeIo *io, int res)
+{
+	struct conn *conn = (struct conn *)io->clientData;
+	char *shared = io->buf;
+	bool ok = true;
+
+	if (conn->flags & CONN_CLOSED) {
+		if (shared)
+			aeReleaseIoBuffer(el, shared);
+		conn_release(conn);
+		return;
+	}
+	if (res == -ENOBUFS && !shared) {
+		/* the loop's buffers are all out, use the conn's own */
+		if (conn_ring_recv(conn, true) < 0)
+			conn->on_error(conn);
+		conn_release(conn);
+		return;
+	}
+	if (res <= 0) {
+		if (res == 0)
+			conn->on_close(conn, 0); //peer closed
+		else
+			conn->on_error(conn);
+		conn_release(conn);
+		return;
+	}
+	conn_read_adapt(conn, res);
+	conn->last_read = el->now;
+	if (shared) {
+		/* the inbuf was empty at submit, on_message() reads in place */
+		if (conn->inbuf.buffer_base)
+			conn_inbuf_drop(conn);
+		conn->inbuf.buffer_base = shared;
+		conn->inbuf.buffer_size = CONN_RING_BUF_SIZE;
+		conn->inbuf.read_index = 0;
+		conn->inbuf.write_index = res;
+		conn->on_message(conn);
+		ok = conn_inbuf_unshare(conn);
+		aeReleaseIoBuffer(el, shared);
+	} else {
+		append_buffer_ex(&conn->inbuf, res);
+		conn->on_message(conn);
+	}
+	if (!ok) {
+		conn->on_error(conn);
+	} else if (!(conn->flags & CONN_CLOSED)) {
+		if (conn->inbuf.buffer_base && !get_buffer_length(&conn->inbuf))
+			conn_inbuf_drop(conn);
+		if (conn_ring_recv(conn, false) < 0)
+			conn->on_error(conn);
+	}
+	conn_release(conn);
+}
+
+/* submit the head of the outbuf unless a send is already in flight;
+ * the segments stay queued, and so in place, until it completes */
+static int conn_ring_send(struct conn *conn)
+{
+	struct conn_ring *ring = conn->ring;
+	int n;
+
+	if (ring->wio.pending || !ez_chain_length(&conn->outbuf))
+		return 0;
+	n = ez_chain_iov(&conn->outbuf, ring->iov, CONN_RING_IOV);
+	memset(&ring->msg, 0, sizeof(ring->msg));
+	ring->msg.msg_iov = ring->iov;
+	ring->msg.msg_iovlen = n;
+	if (aeSubmitSend(conn->el, &ring->wio, conn->sfd, &ring->msg) == AE_ERR)
+		return -1;
+	conn_hold(conn);
+	return 0;
+}
+
+static void conn_ring_send_done(aeEventLoop *el, aeIo *io, int res)
+{
+	struct conn *conn = (struct conn *)io->clientData;
+	size_t before = conn->outbuf.mem_length;
+
+	if (conn->flags & CONN_CLOSED) {
+		conn_release(conn);
+		return;
+	}
+	if (res < 0) {
+		conn->on_error(conn);
+		conn_release(conn);
+		return;
+	}
+	conn_consume(conn, res);
+	if (res)
+		conn->last_write = el->now;
+	/* on_drain() may free the conn */
+	conn_out_update(conn, before);
+	if (!(conn->flags & CONN_CLOSED)) {
+		if (ez_chain_length(&conn->outbuf)) {
+			if (conn_ring_send(conn) < 0)
+				conn->on_error(conn);
+		} else if (conn->conn_status == conn_closing) {
+			conn->on_close(conn, 0);
+		}
+	}
+	conn_release(conn);
+}
+
+/*
+ * Completion mode, for the io_uring backend (see aeCanIo()): instead of
+ * waiting for readiness and then calling read()/write(), the conn keeps
+ * a receive submitted on the loop's ring, and a send while output is
+ * queued. They ride on the loop's one io_uring_enter() per iteration and
+ * complete with the data already moved. Receives land in buffers the
+ * loop hands to the kernel once, as with conn_set_shared_rbuf().
+ *
+ * Use it instead of registering handle_read yourself; it excludes edge
+ * mode, the shared rbuf, zerocopy and conn_send_file(). After
+ * conn_free() the conn is released once its cancelled requests
+ * complete, on a later loop iteration.
+ */
+int conn_set_ring(struct conn *conn)
+{
+	struct conn_loop *loop;
+
+	if (!aeCanIo() || conn->ring || conn->mask != AE_NONE || conn->zc_threshold
+		|| (conn->flags & (CONN_EDGE | CONN_SHARED_RBUF)))
+		return AE_ERR;
+	if (!(loop = conn_loop_get(conn->el))
+		|| !(conn->ring = calloc(1, sizeof(*conn->ring))))
+		return AE_ERR;
+	if (!loop->ring_bufs)
+		loop->ring_bufs = aeSetIoBuffers(conn->el, CONN_RING_BUFS,
+				CONN_RING_BUF_SIZE) == AE_OK ? 1 : -1;
+	conn->ring->rio.proc = conn_ring_recv_done;
+	conn->ring->rio.clientData = conn;
+	conn->ring->wio.proc = conn_ring_send_done;
+	conn->ring->wio.clientData = conn;
+	conn->flags |= CONN_RING;
+	if (conn_ring_recv(conn, false) < 0) {
+		conn->flags &= ~CONN_RING;
+		free(conn->ring);
+		conn->ring = NULL;
+		return AE_ERR;
+	}
+	return AE_OK;
+}
+
+/* the earliest deadline, -1 if none runs; *why is set for one that
+ * already passed */
+static long long conn_deadline_next(struct conn *conn, int *why)
+{
+	long long now = conn->el->now, next = -1, t;
+	long long last = conn->last_read > conn->last_write
+			? conn->last_read : conn->last_write;
+
+	*why = 0;
+	if (conn->idle_timeout) {
+		next = last + conn->idle_timeout;
+		if (next <= now)
+			*why = CONN_TIMEOUT_IDLE;
+	}
+	if (conn->read_timeout) {
+		t = conn->last_read + conn->read_timeout;
+		if (t <= now && !*why)
+			*why = CONN_TIMEOUT_READ;
+		if (next < 0 || t < next)
+			next = t;
+	}
+	if (conn->write_timeout && (conn->flags & CONN_WRITE_WAIT)) {
+		t = conn->last_write + conn->write_timeout;
+		if (t <= now && !*why)
+			*why = CONN_TIMEOUT_WRITE;
+		if (next < 0 || t < next)
+			next = t;
+	}
+	return next;
+}
+
+/* ms from now until t, rounded up so the timer is never early */
+static long long conn_deadline_ms(struct conn *conn, long long t)
+{
+	return (t - conn->el->now + 999) / 1000;
+}
+
+/*
+ * Activity only moves deadlines later and never touches the timer: it
+ * fires at the deadline it was armed for, finds the conn active since,
+ * and re-arms itself for the new deadline.
+ */
+static int conn_deadline_fire(aeEventLoop *el, void *clientData)
+{
+	struct conn *conn = (struct conn *)clientData;
+	long long next;
+	int why;
+
+	next = conn_deadline_next(conn, &why);
+	if (why) {
+		conn_hold(conn);
+		conn->on_timeout(conn, why);
+		if (conn_release(conn) || (conn->flags & CONN_CLOSED))
+			return AE_NOMORE;
+		/* the conn was kept, that deadline starts over */
+		if (why == CONN_TIMEOUT_WRITE)
+			conn->last_write = el->now;
+		else
+			conn->last_read = conn->last_write = el->now;
+		next = conn_deadline_next(conn, &why);
+	}
+	if (next < 0) {
+		conn->timer_id = NULL;
+		return AE_NOMORE;
+	}
+	return conn_deadline_ms(conn, next);
+}
+
+/* arm the timer unless it already fires at or before the deadline */
+static void conn_deadline_arm(struct conn *conn)
+{
+	long long next;
+	int why;
+
+	if ((next = conn_deadline_next(conn, &why)) < 0)
+		return;
+	if (conn->timer_id) {
+		if (conn->timer.when <= next)
+			return;
+		aeModifyTimeEvent(conn->el, conn_deadline_ms(conn, next),
+				&conn->timer);
+		return;
+	}
+	if (aeCreateTimeEvent(conn->el, conn_deadline_ms(conn, next),
+			&conn->timer, conn_deadline_fire, conn) == AE_OK)
+		conn->timer_id = &conn->timer;
+}
+
+int conn_set_timeouts(struct conn *conn, long long idle_ms, long long read_ms,
+		long long write_ms)
+{
+	if (idle_ms < 0 || read_ms < 0 || write_ms < 0)
+		return -1;
+	conn->idle_timeout = idle_ms * 1000;
+	conn->read_timeout = read_ms * 1000;
+	conn->write_timeout = write_ms * 1000;
+	/* deadlines count from now */
+	conn->last_read = conn->last_write = conn->el->now;
+	if (ez_chain_length(&conn->outbuf) && write_ms)
+		conn->flags |= CONN_WRITE_WAIT;
+	else
+		conn->flags &= ~CONN_WRITE_WAIT;
+	if (conn->timer_id) {
+		aeDeleteTimeEvent(conn->el, conn->timer_id);
+		conn->timer_id = NULL;
+	}
+	conn_deadline_arm(conn);
+	return 0;
+}
+
+void conn_set_deferred_flush(struct conn *conn, int on)
+{
+	if (on) {
+		conn->flags |= CONN_DEFER_FLUSH;
+		return;
+	}
+	conn->flags &= ~CONN_DEFER_FLUSH;
+	/* what is queued still goes out before the loop sleeps */
+}
+
+/* Flush every conn that queued output since the last call: one write
+ * per conn per iteration however many messages it sent. */
+void conn_before_sleep(aeEventLoop *el)
+{
+	struct conn_loop *loop = el->connLoop;
+	conn *conn;
+
+	if (!loop)
+		return;
+	while ((conn = loop->dirty)) {
+		conn_dirty_unlink(conn);
+		conn_hold(conn);
+		if (conn_flush(conn) < 0)
+			conn->on_error(conn);
+		else if (!(conn->flags & CONN_CLOSED)
+			&& !ez_chain_length(&conn->outbuf)
+			&& conn->conn_status == conn_closing)
+			conn->on_close(conn, 0);
+		conn_release(conn);
+	}
+}
+
+/*
+ * Call on_high_watermark() once the outbuf holds high bytes or more, and
+ * on_drain() when it is back to low bytes or less, so producers can
+ * pause in between. high 0 turns it off.
+ */
+void conn_set_watermarks(struct conn *conn, size_t high, size_t low)
+{
+	conn->high_watermark = high;
+	conn->low_watermark = low < high ? low : 0;
+	conn->flags &= ~CONN_HIGH_WATER;
+}
+
+/*
+ * Cap the outbuf memory of all conns of the loop together (0 = no cap,
+ * file regions do not count). Over the cap sends fail with ENOBUFS
+ * instead of buffering, the caller is expected to shed that conn.
+ */
+int conn_loop_set_out_cap(aeEventLoop *el, size_t cap)
+{
+	struct conn_loop *loop = conn_loop_get(el);
+
+	if (!loop)
+		return AE_ERR;
+	loop->out_cap = cap;
+	return AE_OK;
+}
+
+void conn_out_get_stats(aeEventLoop *el, struct conn_out_stats *stats)
+{
+	struct conn_loop *loop = el->connLoop;
+
+	memset(stats, 0, sizeof(*stats));
+	if (!loop)
+		return;
+	stats->bytes = loop->out_bytes;
+	stats->cap = loop->out_cap;
+	stats->shed = loop->out_shed;
+}
+
 conn *conn_new(aeEventLoop *el, int sfd)
 {
-	struct conn *conn = malloc(sizeof(*conn));
+	struct conn *conn = conn_alloc(el);
 	if (!conn) {
 		close(sfd);
 		return NULL;
@@ -154,21 +1336,38 @@ conn *conn_new(aeEventLoop *el, int sfd)
 	conn->el = el;
 	conn->sfd = sfd;
 	conn->mask = AE_NONE;
+	conn->flags = 0;
+	conn->refs = 0;
 	conn->timer_id = NULL;
+	conn->pool_next = NULL;
+	conn->dirty_next = NULL;
+	conn->dirty_pprev = NULL;
+	conn->zc_threshold = 0;
+	conn->zc_next = conn->zc_done = 0;
+	conn->zc_copied = 0;
+	conn->read_size = CONN_READ_MIN;
+	conn->read_small = 0;
+	conn->read_budget = CONN_READ_BUDGET;
+	conn->high_watermark = conn->low_watermark = 0;
+	conn->on_high_watermark = NULL;
+	conn->on_drain = NULL;
+	conn->codec = NULL;
+	conn->codec_scan = conn->codec_need = 0;
+	conn->on_frame = NULL;
+	conn->on_free = NULL;
+	conn->free_arg = NULL;
+	conn->owner_free = NULL;
+	conn->owner_arg = NULL;
+	conn->idle_timeout = conn->read_timeout = conn->write_timeout = 0;
+	conn->last_read = conn->last_write = el->now;
+	conn->on_timeout = default_on_timeout;
+	conn->ring = NULL;
 	conn->on_close = default_on_close;
 	conn->on_error = default_on_error;
 	conn->get_message = default_get_message;
 	conn->use_message = default_use_message;
 	conn->send_message = send_message;
-
-	if (!ez_buffer_init(&conn->inbuf)
-		|| !ez_buffer_init(&conn->outbuf))
-		goto out;
-
 	return conn;
-out:
-	conn_free(conn);
-	return NULL;
 }
 
 void set_conn_state(struct conn *conn, enum conn_state st)
@@ -176,3 +1375,32 @@ void set_conn_state(struct conn *conn, enum conn_state st)
 	conn->conn_status = st;
 }
 
+/*
+ * Switch the conn to edge-triggered mode: AE_READABLE and AE_WRITABLE are
+ * registered once with AE_EDGE and stay registered until conn_free(), so
+ * partial writes no longer cost an epoll_ctl() each. Use it instead of
+ * registering handle_read yourself. Returns AE_ERR with nothing
+ * registered if the backend is level-triggered only (see aeCanEdge()),
+ * where a standing AE_WRITABLE would fire on every poll, or if a
+ * registration fails.
+ */
+int conn_set_edge(struct conn *conn)
+{
+	if (!aeCanEdge() || (conn->flags & CONN_RING))
+		return AE_ERR;
+	if (aeCreateFileEvent(conn->el, conn->sfd, AE_READABLE | AE_EDGE,
+			handle_read, conn) == AE_ERR)
+		return AE_ERR;
+	conn->mask |= AE_READABLE;
+	if (aeCreateFileEvent(conn->el, conn->sfd, AE_WRITABLE | AE_EDGE,
+			handle_write, conn) == AE_ERR) {
+		/* handle_read() would stop at read_budget on an edge */
+		aeDeleteFileEvent(conn->el, conn->sfd, AE_READABLE);
+		conn->mask &= ~AE_READABLE;
+		return AE_ERR;
+	}
+	conn->mask |= AE_WRITABLE;
+	conn->flags |= CONN_EDGE;
+	return AE_OK;
+}
+
@@ -4,11 +4,30 @@
 #include <stdbool.h>
 #include "ae.h"
 #include "ez_buffer.h"
+#include "ez_chain.h"
 
 #define CONN_CONNECTED	(1 << 0)
 #define CONN_VERYFIED	(1 << 1)
 #define CONN_CLOSED	(1 << 2)
 #define CONN_CHAP_SEND	(1 << 3)
+#define CONN_EDGE	(1 << 4)	/* edge-triggered, handlers drain to EAGAIN */
+#define CONN_SHARED_RBUF	(1 << 5)	/* read into the loop's buffer when idle */
+#define CONN_HIGH_WATER	(1 << 6)	/* outbuf went over high_watermark */
+#define CONN_DEFER_FLUSH	(1 << 7)	/* sends are written before the loop sleeps */
+#define CONN_DIRTY	(1 << 8)	/* on the loop's list of conns to flush */
+#define CONN_WRITE_WAIT	(1 << 9)	/* outbuf not empty, write deadline runs */
+#define CONN_RING	(1 << 10)	/* completion mode, see conn_set_ring() */
+
+/* why on_timeout() was called */
+#define CONN_TIMEOUT_IDLE	1	/* no bytes either way */
+#define CONN_TIMEOUT_READ	2	/* no bytes received */
+#define CONN_TIMEOUT_WRITE	3	/* queued output made no progress */
+
+/* handle_read() sizing: reads adapt between MIN and MAX bytes, a
+ * level-triggered event reads at most read_budget bytes */
+#define CONN_READ_MIN	512
+#define CONN_READ_MAX	(64 * 1024)
+#define CONN_READ_BUDGET	(256 * 1024)
 
 enum conn_state { 
 	conn_undef,
@@ -17,12 +36,21 @@ enum conn_state {
 	conn_veryfied,
 };
 
+struct codec;
+struct conn_ring;
+
 typedef struct conn {
 	enum conn_state conn_status;
 	int sfd;
 	int mask;
-	aeTimeEvent *timer_id;
+	int flags;	/* CONN_* */
+	int refs;	/* handlers on the stack, conn_free() is deferred */
+	aeTimeEvent *timer_id;	/* &timer while the deadline timer is armed */
+	aeTimeEvent timer;
 	aeEventLoop *el;
+	struct conn *pool_next;	/* free list link while cached by the pool */
+	struct conn *dirty_next;	/* loop's flush list while CONN_DIRTY */
+	struct conn **dirty_pprev;
 	void (*on_error)(struct conn *conn);
 	void (*on_close)(struct conn *conn, int sync_write);
 	void (*on_message)(struct conn *conn);
@@ -30,7 +58,35 @@ typedef struct conn {
 	bool (*use_message)(struct conn *conn, size_t len);
 	int  (*send_message)(struct conn *conn, const char *buf, size_t len);
 	ez_buffer inbuf;
-	ez_buffer outbuf;
+	ez_chain outbuf;	/* segments, appends never copy queued bytes */
+	size_t zc_threshold;	/* MSG_ZEROCOPY from this many bytes, 0 = off */
+	unsigned int zc_next;	/* id of the next zerocopy send */
+	unsigned int zc_done;	/* sends before this id are completed */
+	unsigned long long zc_copied;	/* completions the kernel had to copy */
+	ez_chain zc_pinned;	/* sent segments the kernel may still read */
+	long long zc_linger_until;	/* closed, waiting for completions until */
+	size_t read_size;	/* next read size, adapted to the traffic */
+	int read_small;	/* consecutive reads under half of read_size */
+	size_t read_budget;	/* bytes per readable event, level-triggered */
+	size_t high_watermark;	/* outbuf bytes, 0 = no watermarks */
+	size_t low_watermark;
+	void (*on_high_watermark)(struct conn *conn);
+	void (*on_drain)(struct conn *conn);
+	const struct codec *codec;	/* frame decoder, see codec.h */
+	size_t codec_scan;	/* bytes of a partial frame already scanned */
+	size_t codec_need;	/* size of the partial frame once known */
+	void (*on_frame)(struct conn *conn, const char *frame, size_t len);
+	void (*on_free)(struct conn *conn, void *arg);	/* socket closed, conn gone */
+	void *free_arg;
+	void (*owner_free)(struct conn *conn, void *arg);	/* on_free() of the listener */
+	void *owner_arg;
+	long long idle_timeout;	/* deadlines in us, 0 = off */
+	long long read_timeout;
+	long long write_timeout;
+	long long last_read;	/* aeNow() of the last read / write progress */
+	long long last_write;
+	void (*on_timeout)(struct conn *conn, int why);
+	struct conn_ring *ring;	/* requests in flight, CONN_RING only */
 	char chap[32]; //
 } conn;
 
@@ -38,4 +94,61 @@ int handle_read(aeEventLoop *el, int fd, void *privdata, int mask);
 void conn_free(conn *conn);
 conn *conn_new(aeEventLoop *el, int sfd);
 void set_conn_state(struct conn *conn, enum conn_state st);
+int conn_set_edge(struct conn *conn);
+int conn_set_ring(struct conn *conn);
+int conn_queue(struct conn *conn, const char *buf, size_t len);
+int conn_queue_ref(struct conn *conn, const char *buf, size_t len,
+		ez_release_proc *release, void *arg);
+int conn_flush(struct conn *conn);
+int conn_send_file(struct conn *conn, int fd, off_t off, size_t len);
+
+#define CONN_ZEROCOPY_MIN	(10 * 1024)	/* below this copying is cheaper */
+int conn_set_zerocopy(struct conn *conn, size_t threshold);
+
+/*
+ * Per-loop pool of free conns. conn_free() parks the conn with its
+ * inbuf storage instead of freeing it, conn_new() on the same
+ * loop reuses it. At most high_water conns are kept, the rest are freed.
+ * Without a pool conn_new()/conn_free() use malloc()/free() directly.
+ */
+struct conn_pool_stats {
+	unsigned int cached;	/* free conns held right now */
+	unsigned int high_water;
+	unsigned long long hits;	/* conn_new() served from the pool */
+	unsigned long long misses;	/* conn_new() that had to malloc */
+};
+
+int conn_pool_create(aeEventLoop *el, unsigned int high_water);
+void conn_pool_destroy(aeEventLoop *el);
+void conn_pool_get_stats(aeEventLoop *el, struct conn_pool_stats *stats);
+void conn_loop_free(aeEventLoop *el);
+int conn_set_shared_rbuf(struct conn *conn, int on);
+
+/*
+ * Deferred flushing: send_message() on such a conn only queues, and
+ * conn_before_sleep() writes every conn that queued something once per
+ * loop iteration. Reactor group loops run it as their beforesleep; an
+ * application installing its own beforesleep must call it from there.
+ */
+void conn_set_deferred_flush(struct conn *conn, int on);
+void conn_before_sleep(aeEventLoop *el);
+
+/*
+ * Deadlines, in ms (0 = off): idle fires when nothing was read or
+ * written for idle_ms, read when nothing was read for read_ms, write
+ * when queued output made no progress for write_ms. on_timeout() is
+ * called with CONN_TIMEOUT_*; by default it frees the conn.
+ */
+int conn_set_timeouts(struct conn *conn, long long idle_ms, long long read_ms,
+		long long write_ms);
+
+struct conn_out_stats {
+	size_t bytes;	/* outbuf memory of the loop's conns */
+	size_t cap;
+	unsigned long long shed;	/* sends refused over the cap */
+};
+
+void conn_set_watermarks(struct conn *conn, size_t high, size_t low);
+int conn_loop_set_out_cap(aeEventLoop *el, size_t cap);
+void conn_out_get_stats(aeEventLoop *el, struct conn_out_stats *stats);
 #endif
@@ -94,6 +94,11 @@ bool reserve_space(ez_buffer *ez_buffer, size_t length)
     	} else {
 		size_t new_buffer_size = ez_buffer->write_index - ez_buffer->read_index + length;
 
+		/* grow geometrically so a stream of appends is copied O(1)
+		 * times per byte */
+		if (new_buffer_size < 2 * ez_buffer->buffer_size)
+			new_buffer_size = 2 * ez_buffer->buffer_size;
+
 		char *new_buffer = malloc(new_buffer_size);
 		if (!new_buffer)
 			return false;
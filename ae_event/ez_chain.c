@@ -0,0 +1,261 @@
+/*
+*	chained segment buffer, see ez_chain.h
+*/
+
+#include <string.h>
+#include <stdlib.h>
+#include <stdbool.h>
+
+#include "ez_chain.h"
+
+/* Segments are recycled through caches owned by the thread, so the
+ * loop that frees a segment reuses it without any locking. Reference
+ * and file segments carry no payload and have a cache of their own. */
+struct seg_cache {
+	ez_seg *free;
+	unsigned int n;
+};
+
+static __thread struct seg_cache seg_cache[2];
+
+static ez_seg *seg_alloc(int ref)
+{
+	struct seg_cache *cache = &seg_cache[ref];
+	ez_seg *seg = cache->free;
+
+	if (seg) {
+		cache->free = seg->next;
+		cache->n--;
+	} else if (!(seg = malloc(sizeof(*seg) + (ref ? 0 : EZ_CHAIN_SEG_SIZE)))) {
+		return NULL;
+	}
+	seg->next = NULL;
+	seg->base = (char *)(seg + 1);
+	seg->size = EZ_CHAIN_SEG_SIZE;
+	seg->read_index = seg->write_index = 0;
+	seg->release = NULL;
+	seg->arg = NULL;
+	seg->fd = -1;
+	seg->flags = 0;
+	seg->offset = 0;
+	seg->tag = 0;
+	return seg;
+}
+
+static void seg_release(ez_seg *seg)
+{
+	/* only data segments carry their payload inline */
+	struct seg_cache *cache = &seg_cache[seg->base != (char *)(seg + 1)];
+
+	if (seg->release)
+		seg->release(seg->arg);
+	if (cache->n >= EZ_CHAIN_CACHE_MAX) {
+		free(seg);
+		return;
+	}
+	seg->next = cache->free;
+	cache->free = seg;
+	cache->n++;
+}
+
+void ez_chain_cache_trim(void)
+{
+	ez_seg *seg;
+	int i;
+
+	for (i = 0; i < 2; i++) {
+		while ((seg = seg_cache[i].free)) {
+			seg_cache[i].free = seg->next;
+			free(seg);
+		}
+		seg_cache[i].n = 0;
+	}
+}
+
+static void ez_chain_link(ez_chain *chain, ez_seg *seg)
+{
+	if (chain->tail)
+		chain->tail->next = seg;
+	else
+		chain->head = seg;
+	chain->tail = seg;
+}
+
+void ez_chain_init(ez_chain *chain)
+{
+	chain->head = chain->tail = NULL;
+	chain->length = 0;
+	chain->mem_length = 0;
+}
+
+void ez_chain_free(ez_chain *chain)
+{
+	ez_seg *seg;
+
+	if (!chain)
+		return;
+	while ((seg = chain->head)) {
+		chain->head = seg->next;
+		seg_release(seg);
+	}
+	ez_chain_init(chain);
+}
+
+bool ez_chain_append(ez_chain *chain, const char *data, size_t length)
+{
+	ez_seg *seg = chain->tail;
+
+	if (!data)
+		return false;
+	while (length) {
+		size_t n;
+
+		if (!seg || seg->write_index == seg->size) {
+			/* bytes already appended stay queued on failure */
+			if (!(seg = seg_alloc(0)))
+				return false;
+			ez_chain_link(chain, seg);
+		}
+		n = seg->size - seg->write_index;
+		if (n > length)
+			n = length;
+		memcpy(seg->base + seg->write_index, data, n);
+		seg->write_index += n;
+		chain->length += n;
+		chain->mem_length += n;
+		data += n;
+		length -= n;
+	}
+	return true;
+}
+
+bool ez_chain_append_ref(ez_chain *chain, const char *data, size_t length,
+		ez_release_proc *release, void *arg)
+{
+	ez_seg *seg;
+
+	if (!data || !release)
+		return false;
+	if (!length) {
+		release(arg);
+		return true;
+	}
+	if (!(seg = seg_alloc(1)))
+		return false;
+	seg->base = (char *)data;
+	seg->size = seg->write_index = length;
+	seg->release = release;
+	seg->arg = arg;
+	ez_chain_link(chain, seg);
+	chain->length += length;
+	chain->mem_length += length;
+	return true;
+}
+
+bool ez_chain_append_file(ez_chain *chain, int fd, off_t offset, size_t length,
+		int flags, ez_release_proc *release, void *arg)
+{
+	ez_seg *seg;
+
+	if (fd < 0 || !length)
+		return false;
+	if (!(seg = seg_alloc(1)))
+		return false;
+	seg->base = NULL;
+	seg->size = seg->write_index = length;
+	seg->release = release;
+	seg->arg = arg;
+	seg->fd = fd;
+	seg->flags = flags;
+	seg->offset = offset;
+	ez_chain_link(chain, seg);
+	chain->length += length;
+	return true;
+}
+
+size_t ez_chain_length(ez_chain *chain)
+{
+	return chain->length;
+}
+
+void ez_chain_begin(ez_chain *chain, const char **buffer, size_t *length)
+{
+	ez_seg *seg = chain->head;
+
+	if (seg && seg->fd >= 0)
+		seg = NULL;
+	if (buffer)
+		*buffer = seg ? seg->base + seg->read_index : NULL;
+	if (length)
+		*length = seg ? seg->write_index - seg->read_index : 0;
+}
+
+bool ez_chain_erase(ez_chain *chain, size_t length)
+{
+	return ez_chain_consume(chain, length, NULL, 0);
+}
+
+bool ez_chain_consume(ez_chain *chain, size_t length, ez_chain *keep,
+		unsigned int tag)
+{
+	if (chain->length < length)
+		return false;
+	chain->length -= length;
+	while (length) {
+		ez_seg *seg = chain->head;
+		size_t n = seg->write_index - seg->read_index;
+
+		if (n > length) {
+			seg->read_index += length;
+			if (seg->fd < 0)
+				chain->mem_length -= length;
+			break;
+		}
+		length -= n;
+		if (seg->fd < 0)
+			chain->mem_length -= n;
+		chain->head = seg->next;
+		if (!chain->head)
+			chain->tail = NULL;
+		if (!keep) {
+			seg_release(seg);
+			continue;
+		}
+		/* a kept segment counts all of its bytes again */
+		seg->next = NULL;
+		seg->read_index = 0;
+		seg->tag = tag;
+		ez_chain_link(keep, seg);
+		keep->length += seg->write_index;
+		if (seg->fd < 0)
+			keep->mem_length += seg->write_index;
+	}
+	return true;
+}
+
+void ez_chain_release_upto(ez_chain *chain, unsigned int tag)
+{
+	ez_seg *seg;
+
+	while ((seg = chain->head) && (int)(seg->tag - tag) <= 0) {
+		chain->head = seg->next;
+		if (!chain->head)
+			chain->tail = NULL;
+		chain->length -= seg->write_index - seg->read_index;
+		if (seg->fd < 0)
+			chain->mem_length -= seg->write_index - seg->read_index;
+		seg_release(seg);
+	}
+}
+
+int ez_chain_iov(ez_chain *chain, struct iovec *iov, int max)
+{
+	ez_seg *seg;
+	int n = 0;
+
+	for (seg = chain->head; seg && seg->fd < 0 && n < max; seg = seg->next, n++) {
+		iov[n].iov_base = seg->base + seg->read_index;
+		iov[n].iov_len = seg->write_index - seg->read_index;
+	}
+	return n;
+}
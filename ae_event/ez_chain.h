@@ -0,0 +1,77 @@
+#ifndef __EZ_CHAIN_H__
+#define __EZ_CHAIN_H__
+
+#include <stddef.h>
+#include <stdbool.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+
+/*
+ * Chained buffer of fixed-size segments. Appending never moves bytes
+ * already queued, and a segment goes back to the per-thread segment
+ * cache as soon as its last byte is consumed. An empty chain holds no
+ * memory.
+ *
+ * A reference segment points at the caller's memory instead of copying
+ * it; its release callback runs once the bytes are consumed or the
+ * chain is freed. A file segment stands for a region of a file (or the
+ * next bytes of a pipe) that the writer sends straight from the fd.
+ */
+
+#define EZ_CHAIN_SEG_SIZE	(16 * 1024)	/* payload of one segment */
+#define EZ_CHAIN_CACHE_MAX	64	/* free segments kept per thread */
+
+typedef void ez_release_proc(void *arg);
+
+#define EZ_SEG_PIPE	(1 << 0)	/* file segment reads a pipe, no offset */
+
+typedef struct ez_seg {
+	struct ez_seg *next;
+	char *base;	/* payload, the caller's memory for a reference */
+	size_t size;	/* capacity, a reference is always full */
+	size_t read_index;
+	size_t write_index;
+	ez_release_proc *release;	/* set for a reference segment */
+	void *arg;
+	int fd;	/* file segment source, -1 otherwise */
+	int flags;	/* EZ_SEG_* */
+	off_t offset;	/* file offset of read_index 0 */
+	unsigned int tag;	/* set by ez_chain_consume() */
+} ez_seg;
+
+typedef struct ez_chain {
+	ez_seg *head;
+	ez_seg *tail;
+	size_t length;	/* bytes queued over all segments */
+	size_t mem_length;	/* the part of length held in memory */
+} ez_chain;
+
+void ez_chain_init(ez_chain *chain);
+void ez_chain_free(ez_chain *chain);
+bool ez_chain_append(ez_chain *chain, const char *data, size_t length);
+/* queue data without copying it. On failure release is not called and
+ * the caller still owns data */
+bool ez_chain_append_ref(ez_chain *chain, const char *data, size_t length,
+		ez_release_proc *release, void *arg);
+/* queue length bytes of fd from offset, the chain never reads them */
+bool ez_chain_append_file(ez_chain *chain, int fd, off_t offset, size_t length,
+		int flags, ez_release_proc *release, void *arg);
+size_t ez_chain_length(ez_chain *chain);
+/* get_buffer_begin()/erase_buffer() on the chain: the first contiguous
+ * run of queued bytes (NULL if a file segment comes first), and
+ * consuming bytes from the front */
+void ez_chain_begin(ez_chain *chain, const char **buffer, size_t *length);
+bool ez_chain_erase(ez_chain *chain, size_t length);
+/* like erase, but move the segments used up to keep, tagged with tag,
+ * instead of releasing them; for memory the kernel still references */
+bool ez_chain_consume(ez_chain *chain, size_t length, ez_chain *keep,
+		unsigned int tag);
+/* release the leading segments tagged at or before tag (wrapping) */
+void ez_chain_release_upto(ez_chain *chain, unsigned int tag);
+/* fill at most max iovecs from the front, stopping at a file segment,
+ * return how many */
+int ez_chain_iov(ez_chain *chain, struct iovec *iov, int max);
+/* free the calling thread's segment cache */
+void ez_chain_cache_trim(void);
+
+#endif
@@ -0,0 +1,260 @@
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "ae.h"
+#include "conn.h"
+#include "listener.h"
+
+struct listener {
+	aeEventLoop *el;
+	int fd;
+	int spare_fd;	/* closed to accept and drop a conn on EMFILE */
+	int batch;
+	listener_accept_proc *on_accept;
+	void *privdata;
+	listener_limit *limit;
+	listener_limit own_limit;
+	aeEventLoop **loops;	/* hand-off targets, NULL = own loop */
+	int nloops;
+	int next_loop;
+	struct listener_stats stats;
+};
+
+/* an fd on its way to another loop */
+typedef struct listener_handoff {
+	listener *ls;
+	int fd;
+} listener_handoff;
+
+int listener_socket(const char *addr, int port, int backlog, int reuseport)
+{
+	struct sockaddr_in sa;
+	int fd, on = 1;
+
+	memset(&sa, 0, sizeof(sa));
+	sa.sin_family = AF_INET;
+	sa.sin_port = htons(port);
+	if (!addr)
+		sa.sin_addr.s_addr = htonl(INADDR_ANY);
+	else if (inet_pton(AF_INET, addr, &sa.sin_addr) != 1)
+		return -1;
+
+	if ((fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0)) < 0)
+		return -1;
+	if (setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on)) < 0
+		|| (reuseport && setsockopt(fd, SOL_SOCKET, SO_REUSEPORT,
+				&on, sizeof(on)) < 0)
+		|| bind(fd, (struct sockaddr *)&sa, sizeof(sa)) < 0
+		|| listen(fd, backlog) < 0) {
+		close(fd);
+		return -1;
+	}
+	return fd;
+}
+
+static void listener_conn_gone(struct conn *conn, void *arg)
+{
+	listener_limit *limit = (listener_limit *)arg;
+
+	__atomic_sub_fetch(&limit->active, 1, __ATOMIC_RELAXED);
+}
+
+/* build the conn on the loop that owns it from now on */
+static void listener_start_conn(listener *ls, aeEventLoop *el, int fd)
+{
+	struct conn *conn;
+
+	if (!(conn = conn_new(el, fd))) {
+		/* conn_new() closed the fd */
+		__atomic_sub_fetch(&ls->limit->active, 1, __ATOMIC_RELAXED);
+		return;
+	}
+	/* on_free is the application's */
+	conn->owner_free = listener_conn_gone;
+	conn->owner_arg = ls->limit;
+	ls->on_accept(el, conn, ls->privdata);
+}
+
+static void listener_handoff_task(aeEventLoop *el, void *arg)
+{
+	listener_handoff *h = (listener_handoff *)arg;
+
+	listener_start_conn(h->ls, el, h->fd);
+	free(h);
+}
+
+/* the target loop was deleted with the fd still queued */
+static void listener_handoff_drop(aeEventLoop *el, void *arg)
+{
+	listener_handoff *h = (listener_handoff *)arg;
+
+	close(h->fd);
+	__atomic_sub_fetch(&h->ls->limit->active, 1, __ATOMIC_RELAXED);
+	free(h);
+}
+
+static void listener_dispatch(listener *ls, int fd)
+{
+	aeEventLoop *el;
+	listener_handoff *h;
+
+	if (!ls->nloops) {
+		listener_start_conn(ls, ls->el, fd);
+		return;
+	}
+	el = ls->loops[ls->next_loop];
+	if (++ls->next_loop == ls->nloops)
+		ls->next_loop = 0;
+	if (el == ls->el) {
+		listener_start_conn(ls, el, fd);
+		return;
+	}
+	if (!(h = malloc(sizeof(*h))))
+		goto drop;
+	h->ls = ls;
+	h->fd = fd;
+	if (aeSubmitEx(el, listener_handoff_task, listener_handoff_drop,
+			h) == AE_ERR) {
+		free(h);
+		goto drop;
+	}
+	ls->stats.handed_off++;
+	return;
+drop:
+	close(fd);
+	__atomic_sub_fetch(&ls->limit->active, 1, __ATOMIC_RELAXED);
+}
+
+/* out of fds: free the spare to take the conn off the backlog and drop
+ * it, otherwise it stays readable and the loop spins */
+static void listener_shed_one(listener *ls)
+{
+	int fd;
+
+	ls->stats.fd_exhausted++;
+	if (ls->spare_fd < 0)
+		return;
+	close(ls->spare_fd);
+	if ((fd = accept(ls->fd, NULL, NULL)) >= 0)
+		close(fd);
+	ls->spare_fd = open("/dev/null", O_RDONLY | O_CLOEXEC);
+}
+
+static int listener_accept(aeEventLoop *el, int fd, void *privdata, int mask)
+{
+	listener *ls = (listener *)privdata;
+	listener_limit *limit = ls->limit;
+	unsigned int active;
+	int i, cfd;
+
+	for (i = 0; i < ls->batch; i++) {
+		cfd = accept4(fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+		if (cfd < 0) {
+			if (errno == EINTR || errno == ECONNABORTED)
+				continue;
+			if (errno == EMFILE || errno == ENFILE)
+				listener_shed_one(ls);
+			break;
+		}
+		/* reserve a slot first, other loops may be releasing theirs */
+		active = __atomic_add_fetch(&limit->active, 1, __ATOMIC_RELAXED);
+		if (limit->max && active > limit->max) {
+			__atomic_sub_fetch(&limit->active, 1, __ATOMIC_RELAXED);
+			__atomic_add_fetch(&limit->rejected, 1, __ATOMIC_RELAXED);
+			ls->stats.rejected++;
+			close(cfd);
+			continue;
+		}
+		ls->stats.accepted++;
+		listener_dispatch(ls, cfd);
+	}
+	if (i == ls->batch)
+		ls->stats.batch_full++;
+	return i;
+}
+
+listener *listener_new(aeEventLoop *el, int fd, listener_accept_proc *on_accept,
+		void *privdata)
+{
+	listener *ls;
+
+	if (!on_accept || !(ls = calloc(1, sizeof(*ls))))
+		return NULL;
+	ls->el = el;
+	ls->fd = fd;
+	ls->batch = LISTENER_BATCH;
+	ls->on_accept = on_accept;
+	ls->privdata = privdata;
+	ls->limit = &ls->own_limit;
+	ls->spare_fd = open("/dev/null", O_RDONLY | O_CLOEXEC);
+	if (setnonblock(fd) < 0
+		|| aeCreateFileEvent(el, fd, AE_READABLE, listener_accept, ls) == AE_ERR) {
+		if (ls->spare_fd >= 0)
+			close(ls->spare_fd);
+		free(ls);
+		return NULL;
+	}
+	return ls;
+}
+
+void listener_free(listener *ls)
+{
+	if (!ls)
+		return;
+	aeDeleteFileEvent(ls->el, ls->fd, AE_READABLE);
+	close(ls->fd);
+	if (ls->spare_fd >= 0)
+		close(ls->spare_fd);
+	free(ls->loops);
+	free(ls);
+}
+
+void listener_set_batch(listener *ls, int batch)
+{
+	ls->batch = batch > 0 ? batch : 1;
+}
+
+/* Count the conns against limit instead of the listener's own, so
+ * several listeners can share one; NULL goes back to the own one.
+ * Set it before accepting, live conns keep the limit they started on. */
+void listener_set_limit(listener *ls, listener_limit *limit)
+{
+	ls->limit = limit ? limit : &ls->own_limit;
+}
+
+void listener_set_max_conns(listener *ls, unsigned int max)
+{
+	ls->limit->max = max;
+}
+
+int listener_set_loops(listener *ls, aeEventLoop **loops, int n)
+{
+	aeEventLoop **copy = NULL;
+
+	if (n > 0) {
+		if (!(copy = malloc(n * sizeof(*copy))))
+			return AE_ERR;
+		memcpy(copy, loops, n * sizeof(*copy));
+	}
+	free(ls->loops);
+	ls->loops = copy;
+	ls->nloops = n > 0 ? n : 0;
+	ls->next_loop = 0;
+	return AE_OK;
+}
+
+void listener_get_stats(listener *ls, struct listener_stats *stats)
+{
+	*stats = ls->stats;
+}
@@ -0,0 +1,57 @@
+#ifndef __LISTENER_H__
+#define __LISTENER_H__
+
+#include "ae.h"
+#include "conn.h"
+
+/*
+ * Acceptor for a listening socket registered on one loop. Every
+ * readable event drains up to batch connections with accept4(), so a
+ * burst after a failover takes a few events instead of one per conn.
+ *
+ * Over the connection limit new sockets are accepted and closed right
+ * away, before any conn is built. Accepted fds can be handed round-robin
+ * to a set of loops, the conn is then created on the loop that gets it.
+ */
+
+#define LISTENER_BATCH	64	/* accept4() calls per readable event */
+
+typedef struct listener listener;
+
+/* Called on the loop owning the new conn, see reactor_accept_proc. */
+typedef void listener_accept_proc(aeEventLoop *el, struct conn *conn, void *privdata);
+
+/* Live conns of one or more listeners, shared across threads. */
+typedef struct listener_limit {
+	unsigned int max;	/* 0 = no limit */
+	unsigned int active;	/* updated atomically */
+	unsigned long long rejected;	/* updated atomically */
+} listener_limit;
+
+struct listener_stats {
+	unsigned long long accepted;
+	unsigned long long rejected;	/* closed over the limit */
+	unsigned long long handed_off;	/* fds passed to another loop */
+	unsigned long long batch_full;	/* events that hit the batch limit */
+	unsigned long long fd_exhausted;	/* EMFILE/ENFILE, dropped */
+};
+
+/* Open a nonblocking TCP listening socket on addr:port (NULL = any). */
+int listener_socket(const char *addr, int port, int backlog, int reuseport);
+
+listener *listener_new(aeEventLoop *el, int fd, listener_accept_proc *on_accept,
+		void *privdata);
+/* Unregister and free the listener; fd is closed too. Loops it hands
+ * fds to must be stopped first; deleting them closes fds still queued
+ * for them, so delete them before freeing the listener. */
+void listener_free(listener *ls);
+void listener_set_batch(listener *ls, int batch);
+void listener_set_limit(listener *ls, listener_limit *limit);
+/* max of the current limit, 0 = none */
+void listener_set_max_conns(listener *ls, unsigned int max);
+/* Hand accepted fds round-robin to loops (n 0 keeps them on the
+ * listener's loop). The array is copied. */
+int listener_set_loops(listener *ls, aeEventLoop **loops, int n);
+void listener_get_stats(listener *ls, struct listener_stats *stats);
+
+#endif
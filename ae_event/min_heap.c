@@ -46,10 +46,7 @@ static void min_heap_shift_down_(min_heap_t *s, unsigned hole_index, aeTimeEvent
 
 static int min_heap_elem_greater(aeTimeEvent *a, aeTimeEvent *b)
 {
-	if (a->when_sec > b->when_sec ||
-		(a->when_sec == b->when_sec && a->when_ms > b->when_ms))
-		return 1;
-	return 0;
+	return a->when > b->when;
 }
 
 static void min_heap_ctor(min_heap_t *s) 
@@ -68,6 +65,8 @@ static void min_heap_dtor(min_heap_t *s)
 static void min_heap_elem_init(aeTimeEvent *e) 
 { 
 	e->min_heap_idx = -1;
+	e->next = NULL;
+	e->pprev = NULL;
 }
 
 int min_heap_empty(min_heap_t *s) 
@@ -0,0 +1,226 @@
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/types.h>
+
+#include "ae.h"
+#include "conn.h"
+#include "listener.h"
+#include "reactor_group.h"
+
+typedef struct reactor_loop {
+	aeEventLoop *el;
+	struct reactor_group *group;
+	pthread_t tid;
+	int index;
+	listener *ls;	/* this loop's SO_REUSEPORT listener, NULL if none */
+} reactor_loop;
+
+struct reactor_group {
+	int nloops;
+	int pin;	/* pin loop i to cpu (i % ncpu) */
+	int started;
+	reactor_loop *loops;
+	reactor_init_proc *on_init;
+	void *privdata;
+	listener_limit limit;	/* shared by the listeners of all loops */
+};
+
+reactor_group *reactor_group_new(int nloops, int setsize)
+{
+	reactor_group *group;
+	int i;
+
+	if (nloops <= 0)
+		nloops = sysconf(_SC_NPROCESSORS_ONLN);
+	if (nloops <= 0)
+		nloops = 1;
+
+	if (!(group = calloc(1, sizeof(*group))))
+		return NULL;
+	if (!(group->loops = calloc(nloops, sizeof(reactor_loop)))) {
+		free(group);
+		return NULL;
+	}
+
+	group->nloops = nloops;
+	group->pin = 1;
+	for (i = 0; i < nloops; i++) {
+		reactor_loop *rl = &group->loops[i];
+
+		rl->group = group;
+		rl->index = i;
+		if (!(rl->el = aeCreateEventLoop(setsize))) {
+			reactor_group_free(group);
+			return NULL;
+		}
+	}
+	return group;
+}
+
+void reactor_group_free(reactor_group *group)
+{
+	int i;
+
+	if (!group)
+		return;
+	if (group->started) {
+		reactor_group_stop(group);
+		reactor_group_wait(group);
+	}
+	for (i = 0; i < group->nloops; i++) {
+		reactor_loop *rl = &group->loops[i];
+
+		if (!rl->el)
+			continue;
+		listener_free(rl->ls);
+		conn_loop_free(rl->el);
+		aeDeleteEventLoop(rl->el);
+	}
+	free(group->loops);
+	free(group);
+}
+
+/* Open one SO_REUSEPORT listener per loop on addr:port (addr NULL means
+ * INADDR_ANY). Must be called before reactor_group_start(). */
+int reactor_group_listen(reactor_group *group, const char *addr, int port,
+		int backlog, reactor_accept_proc *on_accept, void *privdata)
+{
+	int i, fd;
+
+	if (group->started || !on_accept)
+		return AE_ERR;
+
+	group->privdata = privdata;
+	for (i = 0; i < group->nloops; i++) {
+		reactor_loop *rl = &group->loops[i];
+
+		if ((fd = listener_socket(addr, port, backlog, 1)) < 0)
+			goto err;
+		/* the conn belongs to the loop that accepted it */
+		if (!(rl->ls = listener_new(rl->el, fd, on_accept, privdata))) {
+			close(fd);
+			goto err;
+		}
+		listener_set_limit(rl->ls, &group->limit);
+	}
+	return AE_OK;
+err:
+	for (i = 0; i < group->nloops; i++) {
+		listener_free(group->loops[i].ls);
+		group->loops[i].ls = NULL;
+	}
+	return AE_ERR;
+}
+
+/* Cap the conns of the whole group (0 = no cap); over it new
+ * connections are closed as they are accepted. */
+void reactor_group_set_max_conns(reactor_group *group, unsigned int max)
+{
+	group->limit.max = max;
+}
+
+void reactor_group_set_init(reactor_group *group, reactor_init_proc *on_init)
+{
+	group->on_init = on_init;
+}
+
+/* Enable (default) or disable pinning loop i to cpu (i % ncpu). */
+void reactor_group_set_affinity(reactor_group *group, int pin)
+{
+	group->pin = pin;
+}
+
+static void reactor_stop_task(aeEventLoop *el, void *arg)
+{
+	aeStop(el);
+}
+
+static void reactor_pin(reactor_loop *rl)
+{
+	cpu_set_t set;
+	long ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+
+	if (ncpu <= 0)
+		return;
+	CPU_ZERO(&set);
+	CPU_SET(rl->index % ncpu, &set);
+	/* best effort, an unpinned loop still works */
+	pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+}
+
+static void *reactor_thread(void *arg)
+{
+	reactor_loop *rl = (reactor_loop *)arg;
+	reactor_group *group = rl->group;
+
+	if (group->pin)
+		reactor_pin(rl);
+	/* on_init may install its own, calling conn_before_sleep() */
+	aeSetBeforeSleepProc(rl->el, conn_before_sleep);
+	if (group->on_init)
+		group->on_init(rl->el, rl->index, group->privdata);
+	aeMain(rl->el);
+	ez_chain_cache_trim();
+	return NULL;
+}
+
+int reactor_group_start(reactor_group *group)
+{
+	int i;
+
+	if (group->started)
+		return AE_ERR;
+
+	for (i = 0; i < group->nloops; i++) {
+		reactor_loop *rl = &group->loops[i];
+
+		if (pthread_create(&rl->tid, NULL, reactor_thread, rl) != 0)
+			goto err;
+		group->started++;
+	}
+	return AE_OK;
+err:
+	reactor_group_stop(group);
+	reactor_group_wait(group);
+	return AE_ERR;
+}
+
+/* Ask every started loop to leave aeMain(). Safe to call from any
+ * thread, the stop runs as a task on each loop. */
+void reactor_group_stop(reactor_group *group)
+{
+	int i;
+
+	for (i = 0; i < group->started; i++)
+		aeSubmit(group->loops[i].el, reactor_stop_task, NULL);
+}
+
+/* Join the loop threads started by reactor_group_start(). */
+void reactor_group_wait(reactor_group *group)
+{
+	int i;
+
+	for (i = 0; i < group->started; i++)
+		pthread_join(group->loops[i].tid, NULL);
+	group->started = 0;
+}
+
+int reactor_group_size(reactor_group *group)
+{
+	return group->nloops;
+}
+
+aeEventLoop *reactor_group_loop(reactor_group *group, int index)
+{
+	if (index < 0 || index >= group->nloops)
+		return NULL;
+	return group->loops[index].el;
+}
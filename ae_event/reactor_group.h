@@ -0,0 +1,38 @@
+#ifndef __REACTOR_GROUP_H__
+#define __REACTOR_GROUP_H__
+
+#include "ae.h"
+#include "conn.h"
+
+/*
+ * A reactor group runs N aeEventLoop instances, one per thread, each
+ * pinned to its own core. Every loop owns a SO_REUSEPORT listener bound
+ * to the same address, so the kernel spreads incoming connections over
+ * the loops. A connection is created on the loop that accepted it and
+ * never migrates: all of its callbacks run on that loop's thread.
+ */
+
+typedef struct reactor_group reactor_group;
+
+/* Called on the accepting loop's thread for every new connection.
+ * The callee installs the conn callbacks and registers AE_READABLE
+ * (handle_read) exactly as it would for a single loop. */
+typedef void reactor_accept_proc(aeEventLoop *el, struct conn *conn, void *privdata);
+
+/* Called once on each loop thread before it enters aeMain(). */
+typedef void reactor_init_proc(aeEventLoop *el, int index, void *privdata);
+
+reactor_group *reactor_group_new(int nloops, int setsize);
+void reactor_group_free(reactor_group *group);
+int reactor_group_listen(reactor_group *group, const char *addr, int port,
+		int backlog, reactor_accept_proc *on_accept, void *privdata);
+void reactor_group_set_max_conns(reactor_group *group, unsigned int max);
+void reactor_group_set_init(reactor_group *group, reactor_init_proc *on_init);
+void reactor_group_set_affinity(reactor_group *group, int pin);
+int reactor_group_start(reactor_group *group);
+void reactor_group_stop(reactor_group *group);
+void reactor_group_wait(reactor_group *group);
+int reactor_group_size(reactor_group *group);
+aeEventLoop *reactor_group_loop(reactor_group *group, int index);
+
+#endif
@@ -0,0 +1,227 @@
+/*
+ * Hierarchical timing wheel, an alternative timer engine to min_heap.c.
+ *
+ * Arm, re-arm and cancel are O(1): a timer is linked into the slot of
+ * the wheel level that covers its distance from now. The root wheel has
+ * one slot per 1ms tick; when it wraps, the matching slot of the next
+ * level is cascaded down (the classic Linux timer wheel). Expired timers
+ * are moved to a pending list and handed out by timer_wheel_pop(), so a
+ * callback may still cancel a timer that expired in the same tick.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "ae.h"
+
+#define TW_ROOT_SIZE	(1 << TW_ROOT_BITS)
+#define TW_ROOT_MASK	(TW_ROOT_SIZE - 1)
+#define TW_LEVEL_SIZE	(1 << TW_LEVEL_BITS)
+#define TW_LEVEL_MASK	(TW_LEVEL_SIZE - 1)
+#define TW_SHIFT(n)	(TW_ROOT_BITS + (n) * TW_LEVEL_BITS)
+#define TW_INDEX(t, n)	(((t) >> TW_SHIFT(n)) & TW_LEVEL_MASK)
+/* farthest distance the wheel can hold, longer timers are clamped and
+ * cascaded again from the last level until they are due */
+#define TW_MAX_TICKS	((1ULL << TW_SHIFT(TW_LEVELS)) - 1)
+
+static void tw_link(aeTimeEvent **head, aeTimeEvent *te)
+{
+	te->next = *head;
+	if (*head)
+		(*head)->pprev = &te->next;
+	*head = te;
+	te->pprev = head;
+}
+
+static void tw_unlink(aeTimeEvent *te)
+{
+	*te->pprev = te->next;
+	if (te->next)
+		te->next->pprev = te->pprev;
+	te->next = NULL;
+	te->pprev = NULL;
+}
+
+/* the pending list is FIFO so timers deferred by the loop's timer
+ * budget run before the ones that expire after them */
+static void tw_pend(timer_wheel_t *tw, aeTimeEvent *te)
+{
+	te->next = NULL;
+	te->pprev = tw->pending_tail;
+	*tw->pending_tail = te;
+	tw->pending_tail = &te->next;
+}
+
+static void tw_del(timer_wheel_t *tw, aeTimeEvent *te)
+{
+	if (tw->pending_tail == &te->next)
+		tw->pending_tail = te->pprev;
+	tw_unlink(te);
+}
+
+static aeTimeEvent **tw_slot(timer_wheel_t *tw, unsigned long long expires)
+{
+	unsigned long long delta;
+	int n;
+
+	/* already due, run it on the next tick */
+	if (expires < tw->now)
+		return &tw->root[tw->now & TW_ROOT_MASK];
+
+	delta = expires - tw->now;
+	if (delta < TW_ROOT_SIZE)
+		return &tw->root[expires & TW_ROOT_MASK];
+	if (delta > TW_MAX_TICKS) {
+		expires = tw->now + TW_MAX_TICKS;
+		delta = TW_MAX_TICKS;
+	}
+	for (n = 0; n < TW_LEVELS - 1; n++)
+		if (delta < (1ULL << TW_SHIFT(n + 1)))
+			break;
+	return &tw->level[n][TW_INDEX(expires, n)];
+}
+
+/* re-insert every timer of level n slot index, return index */
+static int tw_cascade(timer_wheel_t *tw, int n, int index)
+{
+	aeTimeEvent *te, *next;
+
+	te = tw->level[n][index];
+	tw->level[n][index] = NULL;
+	for (; te; te = next) {
+		next = te->next;
+		tw_link(tw_slot(tw, aeTimeEventWhenMs(te)), te);
+	}
+	return index;
+}
+
+timer_wheel_t *timer_wheel_init(timer_wheel_t *tw, unsigned long long now)
+{
+	if (!tw)
+		tw = (timer_wheel_t *)malloc(sizeof(*tw));
+	if (tw) {
+		memset(tw, 0, sizeof(*tw));
+		tw->now = now;
+		tw->pending_tail = &tw->pending;
+	}
+	return tw;
+}
+
+/* timers still armed are left alone, they belong to their owners */
+void timer_wheel_destroy(timer_wheel_t *tw)
+{
+	AE_NOTUSED(tw);
+}
+
+int timer_wheel_add(timer_wheel_t *tw, aeTimeEvent *te)
+{
+	tw_link(tw_slot(tw, aeTimeEventWhenMs(te)), te);
+	tw->n++;
+	return 0;
+}
+
+int timer_wheel_erase(timer_wheel_t *tw, aeTimeEvent *te)
+{
+	if (!te->pprev)
+		return -1;
+	tw_del(tw, te);
+	tw->n--;
+	return 0;
+}
+
+int timer_wheel_elt_pending(const aeTimeEvent *te)
+{
+	return te->pprev != NULL;
+}
+
+unsigned int timer_wheel_size(timer_wheel_t *tw)
+{
+	return tw->n;
+}
+
+/* Run every tick up to and including now, moving the timers that
+ * expire on the way to the pending list. */
+void timer_wheel_advance(timer_wheel_t *tw, unsigned long long now)
+{
+	aeTimeEvent *te;
+
+	if (!tw->n) {
+		if (now >= tw->now)
+			tw->now = now + 1;
+		return;
+	}
+
+	while (tw->now <= now) {
+		int n, index = tw->now & TW_ROOT_MASK;
+
+		if (!index) {
+			for (n = 0; n < TW_LEVELS; n++)
+				if (tw_cascade(tw, n, TW_INDEX(tw->now, n)))
+					break;
+		}
+		while ((te = tw->root[index])) {
+			tw_unlink(te);
+			tw_pend(tw, te);
+		}
+		tw->now++;
+	}
+}
+
+/* Detach one expired timer, NULL when none is pending. */
+aeTimeEvent *timer_wheel_pop(timer_wheel_t *tw)
+{
+	aeTimeEvent *te = tw->pending;
+
+	if (te) {
+		tw_del(tw, te);
+		tw->n--;
+	}
+	return te;
+}
+
+/*
+ * Return the tick at which timer_wheel_advance() may next find work:
+ * either the first busy root slot or the next cascade of a busy slot of
+ * an upper level. 0 means timers are already pending, -1 that the wheel
+ * is empty.
+ */
+long long timer_wheel_next(timer_wheel_t *tw)
+{
+	unsigned long long next = 0;
+	int k, n, found = 0;
+
+	if (tw->pending)
+		return 0;
+	if (!tw->n)
+		return -1;
+
+	for (k = 0; k < TW_ROOT_SIZE; k++) {
+		if (tw->root[(tw->now + k) & TW_ROOT_MASK]) {
+			next = tw->now + k;
+			found = 1;
+			break;
+		}
+	}
+
+	for (n = 0; n < TW_LEVELS; n++) {
+		unsigned long long base = tw->now >> TW_SHIFT(n);
+		unsigned long long when;
+
+		/* the current slot was cascaded already and comes back last,
+		 * unless now sits on its boundary and the cascade is still due */
+		k = (tw->now & ((1ULL << TW_SHIFT(n)) - 1)) ? 1 : 0;
+		for (; k <= TW_LEVEL_SIZE; k++) {
+			if (tw->level[n][(base + k) & TW_LEVEL_MASK])
+				break;
+		}
+		if (k > TW_LEVEL_SIZE)
+			continue;
+		when = (base + k) << TW_SHIFT(n);
+		if (!found || when < next) {
+			next = when;
+			found = 1;
+		}
+	}
+	return found ? (long long)next : -1;
+}
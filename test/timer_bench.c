@@ -0,0 +1,143 @@
+/*
+ * Compare the two ae timer engines, min heap and timing wheel, on the
+ * idle-timeout pattern: arm N timers, re-arm each of them several times
+ * (one re-arm per read on a busy connection), cancel half, then let the
+ * rest expire.
+ *
+ * gcc -O2 -I../ae_event timer_bench.c ../ae_event/min_heap.c \
+ *	../ae_event/timer_wheel.c -o timer_bench
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "ae.h"
+
+#define REARMS		4
+#define MAX_TIMEOUT_MS	60000
+
+static double now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static void set_when(aeTimeEvent *te, unsigned long long ms)
+{
+	te->when = ms * 1000;
+}
+
+static void bench_heap(aeTimeEvent *te, int n)
+{
+	min_heap_t heap;
+	unsigned long long now = 0;
+	double t0, t1, t2, t3, t4;
+	int i, r, fired = 0;
+
+	min_heap_init(&heap);
+	t0 = now_ns();
+	for (i = 0; i < n; i++) {
+		aetimer_event_init(&te[i]);
+		set_when(&te[i], now + 1 + rand() % MAX_TIMEOUT_MS);
+		aetimer_event_add(&heap, &te[i]);
+	}
+	t1 = now_ns();
+	for (r = 0; r < REARMS; r++) {
+		now += 10;
+		for (i = 0; i < n; i++) {
+			min_heap_erase(&heap, &te[i]);
+			set_when(&te[i], now + 1 + rand() % MAX_TIMEOUT_MS);
+			aetimer_event_add(&heap, &te[i]);
+		}
+	}
+	t2 = now_ns();
+	for (i = 0; i < n; i += 2)
+		min_heap_erase(&heap, &te[i]);
+	t3 = now_ns();
+	now += MAX_TIMEOUT_MS + 1;
+	while (min_heap_top(&heap) && aeTimeEventWhenMs(min_heap_top(&heap)) <= now) {
+		min_heap_pop(&heap);
+		fired++;
+	}
+	t4 = now_ns();
+	min_heap_destroy(&heap);
+
+	printf("%-6s %8d  arm %6.1f  rearm %6.1f  cancel %6.1f  expire %6.1f ns/op (%d fired)\n",
+		"heap", n, (t1 - t0) / n, (t2 - t1) / ((double)n * REARMS),
+		(t3 - t2) / (n / 2), (t4 - t3) / (n - n / 2), fired);
+}
+
+static void bench_wheel(aeTimeEvent *te, int n)
+{
+	timer_wheel_t wheel;
+	unsigned long long now = 0, last = 0;
+	double t0, t1, t2, t3, t4;
+	int i, r, fired = 0;
+	aeTimeEvent *e;
+
+	timer_wheel_init(&wheel, now);
+	t0 = now_ns();
+	for (i = 0; i < n; i++) {
+		aetimer_event_init(&te[i]);
+		set_when(&te[i], now + 1 + rand() % MAX_TIMEOUT_MS);
+		timer_wheel_add(&wheel, &te[i]);
+	}
+	t1 = now_ns();
+	for (r = 0; r < REARMS; r++) {
+		now += 10;
+		timer_wheel_advance(&wheel, now);
+		for (i = 0; i < n; i++) {
+			timer_wheel_erase(&wheel, &te[i]);
+			set_when(&te[i], now + 1 + rand() % MAX_TIMEOUT_MS);
+			timer_wheel_add(&wheel, &te[i]);
+		}
+	}
+	t2 = now_ns();
+	for (i = 0; i < n; i += 2)
+		timer_wheel_erase(&wheel, &te[i]);
+	t3 = now_ns();
+	/* walk time forward the way a loop does, one wakeup per next() */
+	while (timer_wheel_size(&wheel)) {
+		long long next = timer_wheel_next(&wheel);
+
+		if (next > (long long)now)
+			now = next;
+		timer_wheel_advance(&wheel, now);
+		while ((e = timer_wheel_pop(&wheel))) {
+			if (aeTimeEventWhenMs(e) > now || aeTimeEventWhenMs(e) < last) {
+				printf("wheel: timer due %llu fired at %llu\n",
+					aeTimeEventWhenMs(e), now);
+				exit(1);
+			}
+			fired++;
+		}
+		last = now;
+	}
+	t4 = now_ns();
+	timer_wheel_destroy(&wheel);
+
+	printf("%-6s %8d  arm %6.1f  rearm %6.1f  cancel %6.1f  expire %6.1f ns/op (%d fired)\n",
+		"wheel", n, (t1 - t0) / n, (t2 - t1) / ((double)n * REARMS),
+		(t3 - t2) / (n / 2), (t4 - t3) / (n - n / 2), fired);
+}
+
+int main(int argc, char *argv[])
+{
+	int sizes[] = { 10000, 100000, 1000000 };
+	unsigned int i;
+
+	for (i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+		aeTimeEvent *te = malloc(sizeof(*te) * sizes[i]);
+
+		if (!te)
+			return 1;
+		srand(i);
+		bench_heap(te, sizes[i]);
+		srand(i);
+		bench_wheel(te, sizes[i]);
+		free(te);
+	}
+	return 0;
+}